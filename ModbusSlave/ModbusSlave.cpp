@@ -2,9 +2,12 @@
  Modbus over serial line - RTU Slave Arduino Sketch 
  
 
- These functions implement functions 3, 6, and 16 (read holding registers,
- preset single register and preset multiple registers) of the 
- Modbus RTU Protocol, to be used over the Arduino serial connection.
+ These functions implement functions 1, 2, 3, 4, 5, 6, 15, 16 and 23 (read
+ coils, discrete inputs, holding and input registers, force single coil,
+ preset single register, force multiple coils, preset multiple registers and
+ read/write multiple registers) of the Modbus RTU Protocol, to be used over
+ the Arduino serial connection. Coils and discrete inputs are kept packed,
+ eight to a byte.
  
  This implementation DOES NOT fully comply with the Modbus specifications.
  
@@ -17,16 +20,28 @@
  */
 
 #include "WProgram.h"
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include "ModbusSlave.h"
 
+/* the USART0 vectors have a 0 in their names on the larger chips */
+#if !defined(USART_RX_vect) && defined(USART0_RX_vect)
+#define USART_RX_vect USART0_RX_vect
+#define USART_UDRE_vect USART0_UDRE_vect
+#define USART_TX_vect USART0_TX_vect
+#endif
+
 /****************************************************************************
  * BEGIN MODBUS RTU SLAVE FUNCTIONS
  ****************************************************************************/
 
 /* constants */
 enum { 
+        MAX_READ_BITS = 0x7D0, 
+        MAX_WRITE_COILS = 0x7B0, 
         MAX_READ_REGS = 0x7D, 
         MAX_WRITE_REGS = 0x7B, 
+        MAX_RW_WRITE_REGS = 0x79, 
         MAX_MESSAGE_LENGTH = 256 
 };
 
@@ -37,6 +52,11 @@ enum {
         CHECKSUM_SIZE = 2 
 };
 
+/* the slave address every slave takes, and none answers */
+enum { 
+        BROADCAST = 0 
+};
+
 /* exceptions code */
 enum { 
         NO_REPLY = -1, 
@@ -57,16 +77,33 @@ enum {
         BYTE_CNT 
 };
 
+/* positions of the write half of a read/write registers query */
+enum { 
+        W_START_H = 6, 
+        W_START_L, 
+        W_REGS_H, 
+        W_REGS_L, 
+        W_BYTE_CNT 
+};
+
 
 /* enum of supported modbus function codes. If you implement a new one, put its function code here ! */
 enum { 
+        FC_READ_COILS = 0x01,   //Read contiguous block of coils
+        FC_READ_INPUTS = 0x02,  //Read contiguous block of discrete inputs
         FC_READ_REGS  = 0x03,   //Read contiguous block of holding register
+        FC_READ_INPUT_REGS = 0x04, //Read contiguous block of input registers
+        FC_WRITE_COIL = 0x05,   //Write single coil
         FC_WRITE_REG  = 0x06,   //Write single holding register
-        FC_WRITE_REGS = 0x10    //Write block of contiguous registers
+        FC_WRITE_COILS = 0x0F,  //Write block of contiguous coils
+        FC_WRITE_REGS = 0x10,   //Write block of contiguous registers
+        FC_READ_WRITE_REGS = 0x17 //Write, then read, blocks of holding registers
 };
 
 /* supported functions. If you implement a new one, put its function code into this array! */
-const unsigned char fsupported[] = { FC_READ_REGS, FC_WRITE_REG, FC_WRITE_REGS };
+const unsigned char fsupported[] PROGMEM = { FC_READ_COILS, FC_READ_INPUTS, FC_READ_REGS, 
+        FC_READ_INPUT_REGS, FC_WRITE_COIL, FC_WRITE_REG, FC_WRITE_COILS, 
+        FC_WRITE_REGS, FC_READ_WRITE_REGS };
 
 
 /*
@@ -83,23 +120,25 @@ CRC
  	Note that this crc is only used for Modbus, not Modbus+ etc. 
  ****************************************************************************/
 
+/* CRC register for each value of the low nibble, see modbus_crc.c */
+static const unsigned int crc_nibble[16] PROGMEM = {
+        0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+        0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+};
+
 unsigned int ModbusSlave::crc(unsigned char *buf, unsigned char start,
 unsigned char cnt) 
 {
-        unsigned char i, j;
-        unsigned temp, temp2, flag;
+        unsigned char i;
+        unsigned temp, temp2;
 
         temp = 0xFFFF;
 
+        /* two table lookups per byte instead of eight shift/xor steps */
         for (i = start; i < cnt; i++) {
                 temp = temp ^ buf[i];
-
-                for (j = 1; j <= 8; j++) {
-                        flag = temp & 0x0001;
-                        temp = temp >> 1;
-                        if (flag)
-                                temp = temp ^ 0xA001;
-                }
+                temp = (temp >> 4) ^ pgm_read_word(&crc_nibble[temp & 0x0F]);
+                temp = (temp >> 4) ^ pgm_read_word(&crc_nibble[temp & 0x0F]);
         }
 
         /* Reverse byte order. */
@@ -113,6 +152,288 @@ unsigned char cnt)
 
 
 
+/***********************************************************************
+ * 
+ * 	Frame buffer
+ * 
+ * 	One buffer holds the frame coming in, the request being served and
+ * the reply going out, which is built over the request in place.
+ * 
+ * 	The USART receive interrupt puts every byte into frame and restarts
+ * Timer1, whose compare B fires at t1.5 and compare A at t3.5 after the
+ * byte. A byte that comes after t1.5 but before t3.5, or with a parity,
+ * framing or overrun error, spoils the frame. At t3.5 the frame is
+ * complete: a good one for this slave, or a broadcast, is left READY for
+ * update(). A newer request replaces one update() has not taken yet;
+ * other frames that come in meanwhile, and everything while update()
+ * works on a request (BUSY) and until its reply is out, are dropped. A
+ * master waits for the reply before it asks again, so that costs
+ * nothing.
+ * 
+ * 	send_reply() starts the data register empty interrupt, which feeds
+ * the reply to the USART a byte at a time. With a driver enable pin,
+ * the transmit complete interrupt drops the pin as soon as the last
+ * stop bit is out. Either way, the buffer is then FREE again.
+ * 
+ ***********************************************************************/
+
+enum { 
+        FRAME_FREE = 0, 
+        FRAME_READY, 
+        FRAME_BUSY 
+};
+
+static unsigned char frame[MAX_MESSAGE_LENGTH];
+static volatile unsigned char frame_state;
+static volatile unsigned int frame_length;	/* of the READY frame */
+
+static unsigned char rx_slave;			/* our address */
+static volatile unsigned int rx_count;		/* bytes of the frame coming in */
+static volatile unsigned char rx_bad;		/* it is to be dropped */
+static volatile unsigned char rx_gap;		/* t1.5 has passed since the last byte */
+
+static volatile unsigned char tx_length;
+static volatile unsigned char tx_pos;
+static volatile unsigned char tx_busy;
+static volatile uint8_t *tx_en_port; 	/* the driver enable pin, */
+static uint8_t tx_en_mask;		/* 0 if there is none     */
+
+ISR(USART_RX_vect)
+{
+        unsigned char status = UCSR0A;
+        unsigned char c = UDR0;
+
+        /* restart the t1.5 and t3.5 timeouts */
+        TCNT1 = 0;
+        TIFR1 = (1 << OCF1A) | (1 << OCF1B);
+        TIMSK1 |= (1 << OCIE1A) | (1 << OCIE1B);
+
+        if (rx_gap) 		/* a pause inside the frame */
+                rx_bad = 1;
+        if (status & ((1 << FE0) | (1 << DOR0) | (1 << UPE0)))
+                rx_bad = 1;
+
+        /* a newer request replaces the one waiting */
+        if (0 == rx_count && FRAME_READY == frame_state
+            && (rx_slave == c || BROADCAST == c))
+                frame_state = FRAME_FREE;
+
+        if (FRAME_FREE != frame_state || rx_count >= MAX_MESSAGE_LENGTH)
+                rx_bad = 1; 	/* nowhere to put it */
+        else
+                frame[rx_count] = c;
+        rx_count++;
+}
+
+/* t1.5 */
+ISR(TIMER1_COMPB_vect)
+{
+        TIMSK1 &= ~(1 << OCIE1B);
+        rx_gap = 1;
+}
+
+/* t3.5, the end of the frame */
+ISR(TIMER1_COMPA_vect)
+{
+        TIMSK1 &= ~((1 << OCIE1A) | (1 << OCIE1B));
+
+        /* 4 bytes is the shortest frame: address, function and CRC */
+        if (rx_count >= 4 && !rx_bad
+            && (rx_slave == frame[SLAVE] || BROADCAST == frame[SLAVE])) {
+                frame_length = rx_count;
+                frame_state = FRAME_READY;
+        }
+        rx_count = 0;
+        rx_bad = 0;
+        rx_gap = 0;
+}
+
+ISR(USART_UDRE_vect)
+{
+        UDR0 = frame[tx_pos++];
+        if (tx_pos < tx_length)
+                return;
+
+        /* the last byte is in; wait for it to leave the shift register */
+        UCSR0B &= ~(1 << UDRIE0);
+        if (tx_en_mask) {
+                UCSR0A |= 1 << TXC0;
+                UCSR0B |= 1 << TXCIE0;
+        } else {
+                tx_busy = 0;
+                frame_state = FRAME_FREE;
+        }
+}
+
+ISR(USART_TX_vect)
+{
+        UCSR0B &= ~(1 << TXCIE0);
+        *tx_en_port &= ~tx_en_mask; 	/* back to listen mode */
+        tx_busy = 0;
+        frame_state = FRAME_FREE;
+}
+
+
+/***********************************************************************
+ * 
+ * 	get_bits(bits_array, first_bit, number_of_bits, packed_output)
+ * 	put_bits(bits_array, first_bit, number_of_bits, packed_input)
+ * 
+ * 	copy bits between a packed table and a frame, where they start
+ * at bit 0 of the first byte; a byte at a time, shifted into place.
+ * 
+ ***********************************************************************/
+
+static void get_bits(const unsigned char *bits, unsigned int start,
+unsigned int count, unsigned char *out) 
+{
+        unsigned int first = start >> 3;
+        unsigned int last = (start + count - 1) >> 3;
+        unsigned char shift = start & 7;
+        unsigned int i, bytes = (count + 7) / 8;
+
+        for (i = 0; i < bytes; i++) {
+                out[i] = bits[first + i] >> shift;
+                if (shift && first + i + 1 <= last)
+                        out[i] |= bits[first + i + 1] << (8 - shift);
+        }
+        if (count & 7)
+                out[bytes - 1] &= (1 << (count & 7)) - 1;
+}
+
+static void put_bits(unsigned char *bits, unsigned int start,
+unsigned int count, const unsigned char *in) 
+{
+        unsigned int i, pos, n;
+        unsigned char shift, val, mask;
+
+        for (i = 0; i < count; i += n) {
+                /* up to the end of the table byte at pos */
+                pos = start + i;
+                shift = pos & 7;
+                n = 8 - shift;
+                if (n > count - i)
+                        n = count - i;
+
+                val = in[i >> 3] >> (i & 7);
+                if ((i & 7) + n > 8)
+                        val |= in[(i >> 3) + 1] << (8 - (i & 7));
+                mask = ((1 << n) - 1) << shift;
+                bits[pos >> 3] = (bits[pos >> 3] & ~mask) | ((val << shift) & mask);
+        }
+}
+
+
+/***********************************************************************
+ *
+ * 	find_segment(map, segments, address)
+ *
+ * 	the segment of a register map holding address, by a binary search
+ * of the map, which is sorted by start address.
+ *
+ * Returns:	the segment, 0 if address is in none of them
+ *
+ ***********************************************************************/
+
+static const struct modbus_segment *find_segment(
+const struct modbus_segment *map, unsigned char segments, unsigned int addr)
+{
+        unsigned char lo = 0, hi = segments, mid;
+
+        /* lo ends up past the last segment starting at or below addr */
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (map[mid].start <= addr)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        if (0 == lo || addr - map[lo - 1].start >= map[lo - 1].length)
+                return 0;
+        return &map[lo - 1];
+}
+
+/***********************************************************************
+ *
+ * 	map_covers(map, segments, first_register, number_of_registers,
+ * writing)
+ *
+ * 	checks that all the registers of a request exist and can be read
+ * (or written): they may run from one segment on into the next, but
+ * only if it starts where the other ends.
+ *
+ * Returns:	1 if so, 0 if not
+ *
+ ***********************************************************************/
+
+static unsigned char map_covers(const struct modbus_segment *map,
+unsigned char segments, unsigned int start, unsigned int count,
+unsigned char writing)
+{
+        const struct modbus_segment *seg = find_segment(map, segments, start);
+        unsigned long end = (unsigned long) start + count;
+        unsigned long seg_end;
+
+        while (seg) {
+                if (!seg->regs && (writing ? !seg->set : !seg->get))
+                        return 0;
+                seg_end = (unsigned long) seg->start + seg->length;
+                if (end <= seg_end)
+                        return 1;
+                if (++seg == map + segments || seg->start != seg_end)
+                        return 0;
+        }
+        return 0;
+}
+
+/***********************************************************************
+ *
+ * 	get_regs(map, segments, first_register, number_of_registers,
+ * output)
+ * 	put_regs(map, segments, first_register, number_of_registers,
+ * input)
+ *
+ * 	copy registers between a register map and a frame, where they are
+ * high byte first. The range must have passed map_covers(): there is one
+ * search for the first segment, and the rest follow in order.
+ *
+ ***********************************************************************/
+
+static void get_regs(const struct modbus_segment *map, unsigned char segments,
+unsigned int start, unsigned int count, unsigned char *out)
+{
+        const struct modbus_segment *seg = find_segment(map, segments, start);
+        unsigned int addr = start;
+        int val;
+
+        for (; count; count--, addr++) {
+                if (addr - seg->start >= seg->length)
+                        seg++;
+                val = seg->regs ? seg->regs[addr - seg->start] : seg->get(addr);
+                *out++ = val >> 8;
+                *out++ = val & 0x00FF;
+        }
+}
+
+static void put_regs(const struct modbus_segment *map, unsigned char segments,
+unsigned int start, unsigned int count, const unsigned char *in)
+{
+        const struct modbus_segment *seg = find_segment(map, segments, start);
+        unsigned int addr = start;
+        int val;
+
+        for (; count; count--, addr++, in += 2) {
+                if (addr - seg->start >= seg->length)
+                        seg++;
+                val = (int) in[0] << 8 | (int) in[1];
+                if (seg->regs)
+                        seg->regs[addr - seg->start] = val;
+                else
+                        seg->set(addr, val);
+        }
+}
+
+
 /***********************************************************************
  * 
  * 	The following functions construct the required query into
@@ -136,15 +457,15 @@ unsigned char count, unsigned char *packet)
  */
 void ModbusSlave::build_write_packet(unsigned char function,
 unsigned int start_addr, 
-unsigned char count,
+unsigned int count,
 unsigned char *packet) 
 {
         packet[SLAVE] = slave;
         packet[FUNC] = function;
         packet[START_H] = start_addr >> 8;
         packet[START_L] = start_addr & 0x00ff;
-        packet[REGS_H] = 0x00;
-        packet[REGS_L] = count;
+        packet[REGS_H] = count >> 8;
+        packet[REGS_L] = count & 0x00ff;
 } 
 
 /* 
@@ -199,57 +520,49 @@ void ModbusSlave::modbus_reply(unsigned char *packet, unsigned char string_lengt
  * 
  * send_reply( query_string, query_length )
  * 
- * Function to send a reply to a modbus master.
- * Returns: total number of characters sent
+ * Function to start sending a reply to a modbus master; the transmit
+ * interrupts send it while the sketch goes on. The reply is in the
+ * frame buffer.
+ * Returns: total number of characters to be sent
  ************************************************************************/
 
 int ModbusSlave::send_reply(unsigned char *query, unsigned char string_length) 
 {
-        unsigned char i;
-
-        if (txenpin > 1) { // set MAX485 to speak mode 
-                UCSR0A=UCSR0A |(1 << TXC0);
-                digitalWrite( txenpin, HIGH);
-                delay(1);
-        }
-
         modbus_reply(query, string_length);
         string_length += 2;
 
-        for (i = 0; i < string_length; i++) {
-                Serial.print(query[i], BYTE);
-        }
+        tx_length = string_length;
+        tx_pos = 0;
+        tx_busy = 1;
 
-        if (txenpin > 1) {// set MAX485 to listen mode 
-                while (!(UCSR0A & (1 << TXC0)));
-                digitalWrite( txenpin, LOW);
-        }
+        if (tx_en_mask) // set MAX485 to speak mode 
+                *tx_en_port |= tx_en_mask;
+        UCSR0B |= 1 << UDRIE0;
 
-        return i; 		/* it does not mean that the write was succesful, though */
+        return string_length; 	/* it does not mean that the write was succesful, though */
 }
 
 /***********************************************************************
  * 
- * 	receive_request( array_for_data )
+ * 	receive_request()
  * 
- * Function to monitor for a request from the modbus master.
+ * Function to take the frame the receiver has completed, if any; it
+ * stays in the frame buffer, which is BUSY until update() is done.
  * 
  * Returns:	Total number of characters received if OK
  * 0 if there is no request 
- * A negative error code on failure
  ***********************************************************************/
 
-int ModbusSlave::receive_request(unsigned char *received_string) 
+int ModbusSlave::receive_request(void) 
 {
         int bytes_received = 0;
 
-        /* FIXME: does Serial.available wait 1.5T or 3.5T before exiting the loop? */
-        while (Serial.available()) {
-                received_string[bytes_received] = Serial.read();
-                bytes_received++;
-                if (bytes_received >= MAX_MESSAGE_LENGTH)
-                        return NO_REPLY; 	/* port error */
+        cli();
+        if (FRAME_READY == frame_state) {
+                frame_state = FRAME_BUSY;
+                bytes_received = frame_length;
         }
+        sei();
 
         return (bytes_received);
 }
@@ -279,7 +592,7 @@ int ModbusSlave::modbus_request(unsigned char *data)
         unsigned char recv_crc_hi;
         unsigned char recv_crc_lo;
 
-        response_length = receive_request(data);
+        response_length = receive_request();
 
         if (response_length > 0) {
                 crc_calc = crc(data, 0, response_length - 2);
@@ -296,7 +609,7 @@ int ModbusSlave::modbus_request(unsigned char *data)
                 }
 
                 /* check for slave id */
-                if (slave != data[SLAVE]) {
+                if (slave != data[SLAVE] && BROADCAST != data[SLAVE]) {
                         return NO_REPLY;
                 }
         }
@@ -305,9 +618,11 @@ int ModbusSlave::modbus_request(unsigned char *data)
 
 /*********************************************************************
  * 
- * 	validate_request(request_data_array, request_length, available_regs)
+ * 	validate_request(request_data_array, request_length, register_map,
+ * number_of_segments)
  * 
  * Function to check that the request can be processed by the slave.
+ * The whole range of registers or bits is checked here, once.
  * 
  * Returns:	0 if OK
  * 		A negative exception code on error
@@ -315,83 +630,135 @@ int ModbusSlave::modbus_request(unsigned char *data)
  **********************************************************************/
 
 int ModbusSlave::validate_request(unsigned char *data, unsigned char length,
-unsigned int regs_size) 
+const struct modbus_segment *map, unsigned char segments) 
 {
         int i, fcnt = 0;
         unsigned int regs_num = 0;
         unsigned int start_addr = 0;
-        unsigned char max_regs_num;
+        unsigned int max_regs_num;
+        unsigned int table_size = 0;
+        unsigned int frame_size;
+        const struct modbus_segment *table_map = 0;	/* registers, */
+        unsigned char table_segments = 0;		/* if not bits */
 
         /* check function code */
         for (i = 0; i < sizeof(fsupported); i++) {
-                if (fsupported[i] == data[FUNC]) {
+                if (pgm_read_byte(&fsupported[i]) == data[FUNC]) {
                         fcnt = 1;
                         break;
                 }
         }
         if (0 == fcnt)
                 return EXC_FUNC_CODE;
+
+        /* the frame must be as long as its function or byte count says; */
+        /* a short one would leave stale bytes of the buffer to be used  */
+        switch (data[FUNC]) {
+        case FC_WRITE_COILS:
+        case FC_WRITE_REGS:
+                frame_size = BYTE_CNT + 1 + data[BYTE_CNT] + CHECKSUM_SIZE;
+                break;
+        case FC_READ_WRITE_REGS:
+                frame_size = W_BYTE_CNT + 1 + data[W_BYTE_CNT] + CHECKSUM_SIZE;
+                break;
+        default:        /* FC01 to FC06: address, quantity or value */
+                frame_size = BYTE_CNT + CHECKSUM_SIZE;
+                break;
+        }
+        if (length != frame_size)
+                return EXC_REGS_QUANT;
                 
         if (FC_WRITE_REG == data[FUNC]) {
                 /* For function write single reg, this is the target reg.*/
                 regs_num = ((int) data[START_H] << 8) + (int) data[START_L];
-                if (regs_num >= regs_size)
+                if (!map_covers(map, segments, regs_num, 1, 1))
                         return EXC_ADDR_RANGE;
                 return 0;
         }                
 
-        /* For functions read/write regs, this is the range. */
+        if (FC_WRITE_COIL == data[FUNC]) {
+                /* the value is ON (0xFF00) or OFF (0x0000), nothing else */
+                if (data[REGS_L] || (data[REGS_H] && 0xFF != data[REGS_H]))
+                        return EXC_REGS_QUANT;
+                regs_num = ((int) data[START_H] << 8) + (int) data[START_L];
+                if (regs_num >= coils_size)
+                        return EXC_ADDR_RANGE;
+                return 0;
+        }
+
+        /* For functions read/write regs or bits, this is the range. */
         regs_num = ((int) data[REGS_H] << 8) + (int) data[REGS_L];
 
-        /* check quantity of registers */
-        if (FC_READ_REGS == data[FUNC])
+        /* check quantity of registers or bits, in the table they are in */
+        switch (data[FUNC]) {
+        case FC_READ_COILS:
+                max_regs_num = MAX_READ_BITS;
+                table_size = coils_size;
+                break;
+        case FC_READ_INPUTS:
+                max_regs_num = MAX_READ_BITS;
+                table_size = inputs_size;
+                break;
+        case FC_READ_INPUT_REGS:
                 max_regs_num = MAX_READ_REGS;
-        else if (FC_WRITE_REGS == data[FUNC])
+                table_map = input_map;
+                table_segments = input_segments;
+                break;
+        case FC_WRITE_COILS:
+                max_regs_num = MAX_WRITE_COILS;
+                table_size = coils_size;
+                break;
+        case FC_WRITE_REGS:
                 max_regs_num = MAX_WRITE_REGS;
+                table_map = map;
+                table_segments = segments;
+                break;
+        default:        /* FC_READ_REGS, FC_READ_WRITE_REGS */
+                max_regs_num = MAX_READ_REGS;
+                table_map = map;
+                table_segments = segments;
+                break;
+        }
 
         if ((regs_num < 1) || (regs_num > max_regs_num))
                 return EXC_REGS_QUANT;
+        if (FC_WRITE_COILS == data[FUNC] && data[BYTE_CNT] != (regs_num + 7) / 8)
+                return EXC_REGS_QUANT;
+        if (FC_WRITE_REGS == data[FUNC] && data[BYTE_CNT] != regs_num * 2)
+                return EXC_REGS_QUANT;
 
         /* check registers range, start address is 0 */
         start_addr = ((int) data[START_H] << 8) + (int) data[START_L];
-        if ((start_addr + regs_num) > regs_size)
+        if (table_map) {
+                if (!map_covers(table_map, table_segments, start_addr, regs_num,
+                                FC_WRITE_REGS == data[FUNC]))
+                        return EXC_ADDR_RANGE;
+        } else if (start_addr >= table_size
+                   || regs_num > table_size - start_addr) {
+                /* not start_addr + regs_num, which can wrap at 16 bits */
                 return EXC_ADDR_RANGE;
+        }
+
+        if (FC_READ_WRITE_REGS == data[FUNC]) {
+                /* and the same for the write half */
+                regs_num = ((int) data[W_REGS_H] << 8) + (int) data[W_REGS_L];
+                if ((regs_num < 1) || (regs_num > MAX_RW_WRITE_REGS)
+                    || (data[W_BYTE_CNT] != regs_num * 2))
+                        return EXC_REGS_QUANT;
+                start_addr = ((int) data[W_START_H] << 8) + (int) data[W_START_L];
+                if (!map_covers(map, segments, start_addr, regs_num, 1))
+                        return EXC_ADDR_RANGE;
+        }
 
         return 0; 		/* OK, no exception */
 }
 
 
 
-/************************************************************************
- * 
- * 	write_regs(first_register, data_array, registers_array)
- * 
- * 	writes into the slave's holding registers the data in query, 
- * starting at start_addr.
- * 
- * Returns:   the number of registers written
- ************************************************************************/
-
-int ModbusSlave::write_regs(unsigned int start_addr, unsigned char *query, int *regs) 
-{
-        int temp;
-        unsigned int i;
-
-        for (i = 0; i < query[REGS_L]; i++) {
-                /* shift reg hi_byte to temp */
-                temp = (int) query[(BYTE_CNT + 1) + i * 2] << 8;
-                /* OR with lo_byte           */
-                temp = temp | (int) query[(BYTE_CNT + 2) + i * 2];
-
-                regs[start_addr + i] = temp;
-        } 
-        return i;
-}
-
 /************************************************************************
  * 
  * 	preset_multiple_registers(first_register, number_of_registers,
- * data_array, registers_array)
+ * data_array, register_map, number_of_segments)
  * 
  * 	Write the data from an array into the holding registers of the slave. 
  * 
@@ -400,80 +767,190 @@ int ModbusSlave::write_regs(unsigned int start_addr, unsigned char *query, int *
 int ModbusSlave::preset_multiple_registers(unsigned int start_addr,
 unsigned char count, 
 unsigned char *query,
-int *regs) 
+const struct modbus_segment *map, unsigned char segments) 
 {
         unsigned char function = FC_WRITE_REGS;	/* Preset Multiple Registers */
-        int status = 0;
-        unsigned char packet[RESPONSE_SIZE + CHECKSUM_SIZE];
-
-        build_write_packet(function, start_addr, count, packet);
 
-        if (write_regs(start_addr, query, regs)) {
-                status = send_reply(packet, RESPONSE_SIZE);
-        }
+        put_regs(map, segments, start_addr, count, query + BYTE_CNT + 1);
+        build_write_packet(function, start_addr, count, query);
 
-        return (status);
+        return send_reply(query, RESPONSE_SIZE);
 }
 
 /************************************************************************
  * 
- * write_single_register(slave_id, write_addr, data_array, registers_array)
+ * write_single_register(write_addr, data_array, register_map,
+ * number_of_segments)
  * 
  * Write a single int val into a single holding register of the slave. 
  * 
  *************************************************************************/
 
-int ModbusSlave::write_single_register(unsigned int write_addr, unsigned char *query, int *regs) 
+int ModbusSlave::write_single_register(unsigned int write_addr,
+unsigned char *query, const struct modbus_segment *map, unsigned char segments) 
 {
         unsigned char function = FC_WRITE_REG; /* Function: Write Single Register */
         int status = 0;
         unsigned int reg_val;
-        unsigned char packet[RESPONSE_SIZE + CHECKSUM_SIZE];
 
+        put_regs(map, segments, write_addr, 1, query + REGS_H);
         reg_val = query[REGS_H] << 8 | query[REGS_L];
-        build_write_single_packet(function, write_addr, reg_val, packet);
-        regs[write_addr] = (int) reg_val;
+        build_write_single_packet(function, write_addr, reg_val, query);
 /*
         written.start_addr=write_addr;
         written.num_regs=1;
 */
-        status = send_reply(packet, RESPONSE_SIZE);    
+        status = send_reply(query, RESPONSE_SIZE);    
 
         return (status);
 }
 
 /************************************************************************
  * 
- * 	read_holding_registers(first_register, number_of_registers,
- * registers_array)
+ * 	read_registers(function, first_register, number_of_registers,
+ * register_map, number_of_segments, reply_array)
  * 
- * reads the slave's holdings registers and sends them to the Modbus master
+ * reads the slave's holding (FC03) or input (FC04) registers and sends
+ * them to the Modbus master
  * 
  *************************************************************************/
 
-int ModbusSlave::read_holding_registers( unsigned int start_addr,
+int ModbusSlave::read_registers(unsigned char function, unsigned int start_addr,
+unsigned char reg_count, const struct modbus_segment *map,
+unsigned char segments, unsigned char *packet) 
+{
+        build_read_packet(function, reg_count, packet);
+        get_regs(map, segments, start_addr, reg_count, packet + 3);
+
+        return send_reply(packet, 3 + 2 * reg_count);
+}
+
+/************************************************************************
+ * 
+ * 	read_bits(function, first_bit, number_of_bits, bits_array,
+ * reply_array)
+ * 
+ * reads the slave's coils (FC01) or discrete inputs (FC02) and sends
+ * them to the Modbus master, packed as they are kept.
+ * 
+ *************************************************************************/
 
-unsigned char reg_count, int *regs) 
+int ModbusSlave::read_bits(unsigned char function, unsigned int start_addr,
+unsigned int bit_count, unsigned char *bits, unsigned char *packet) 
 {
-        unsigned char function = FC_READ_REGS; 	/* Read Holding Registers */
-        int packet_size = 3;
-        int status;
-        unsigned int i;
-        unsigned char packet[MAX_MESSAGE_LENGTH];
+        packet[SLAVE] = slave;
+        packet[FUNC] = function;
+        packet[2] = (bit_count + 7) / 8;
+        get_bits(bits, start_addr, bit_count, packet + 3);
 
-        build_read_packet(function, reg_count, packet);
+        return send_reply(packet, 3 + packet[2]);
+}
 
-        for (i = start_addr; i < (start_addr + (unsigned int) reg_count);
-	       i++) {
-                        packet[packet_size] = regs[i] >> 8;
-                packet_size++;
-                packet[packet_size] = regs[i] & 0x00FF;
-                packet_size++;
-        } 
+/************************************************************************
+ * 
+ * 	force_single_coil(coil_addr, data_array)
+ * 
+ * turns a single coil on (0xFF00) or off (0x0000).
+ * 
+ *************************************************************************/
 
-        status = send_reply(packet, packet_size);
+int ModbusSlave::force_single_coil(unsigned int coil_addr, unsigned char *query) 
+{
+        unsigned char on = query[REGS_H] ? 1 : 0;
 
-        return (status);
+        put_bits(coils, coil_addr, 1, &on);
+
+        /* the reply is the request as it is */
+        return send_reply(query, RESPONSE_SIZE);
+}
+
+/************************************************************************
+ * 
+ * 	force_multiple_coils(first_coil, number_of_coils, data_array)
+ * 
+ * writes the packed bits in query into the slave's coils.
+ * 
+ *************************************************************************/
+
+int ModbusSlave::force_multiple_coils(unsigned int start_addr,
+unsigned int coil_count, unsigned char *query) 
+{
+        put_bits(coils, start_addr, coil_count, query + BYTE_CNT + 1);
+
+        build_write_packet(FC_WRITE_COILS, start_addr, coil_count, query);
+        return send_reply(query, RESPONSE_SIZE);
+}
+
+/************************************************************************
+ * 
+ * 	read_write_registers(first_register, number_of_registers,
+ * data_array, register_map, number_of_segments)
+ * 
+ * writes the registers in the write half of query, then reads
+ * reg_count registers from start_addr and sends them to the Modbus
+ * master, in one transaction.
+ * 
+ *************************************************************************/
+
+int ModbusSlave::read_write_registers(unsigned int start_addr,
+unsigned char reg_count, unsigned char *query,
+const struct modbus_segment *map, unsigned char segments) 
+{
+        unsigned char function = FC_READ_WRITE_REGS; 	/* Read/Write Multiple Registers */
+        unsigned int write_addr;
+        unsigned char *packet = query; 	/* after the write is done */
+
+        write_addr = ((int) query[W_START_H] << 8) + (int) query[W_START_L];
+        put_regs(map, segments, write_addr, query[W_REGS_L],
+                query + W_BYTE_CNT + 1);
+
+        return read_registers(function, start_addr, reg_count, map, segments,
+                packet);
+}
+
+/*
+ * set_coils(coils, coils_size)  set_inputs(inputs, inputs_size)
+ * set_input_regs(input_regs, input_regs_size)
+ * set_input_map(map, segments)  set_holding_map(map, segments)
+ *
+ * hand the slave its coil, discrete input and input register tables, or
+ * register maps. An input register array is kept as a map of one segment.
+ */
+
+void ModbusSlave::set_coils(unsigned char *coils, unsigned int coils_size)
+{
+        this->coils = coils;
+        this->coils_size = coils_size;
+}
+
+void ModbusSlave::set_inputs(unsigned char *inputs, unsigned int inputs_size)
+{
+        this->inputs = inputs;
+        this->inputs_size = inputs_size;
+}
+
+void ModbusSlave::set_input_regs(int *input_regs, unsigned int input_regs_size)
+{
+        input_seg.start = 0;
+        input_seg.length = input_regs_size;
+        input_seg.regs = input_regs;
+        input_seg.get = 0;
+        input_seg.set = 0;
+        set_input_map(&input_seg, 1);
+}
+
+void ModbusSlave::set_input_map(const struct modbus_segment *map,
+unsigned char segments)
+{
+        input_map = map;
+        input_segments = segments;
+}
+
+void ModbusSlave::set_holding_map(const struct modbus_segment *map,
+unsigned char segments)
+{
+        holding_map = map;
+        holding_segments = segments;
 }
 
 /* 
@@ -493,10 +970,19 @@ unsigned char reg_count, int *regs)
 
 void ModbusSlave::configure(unsigned char slave, long baud, char parity, char txenpin)
 {
+        unsigned long t15, t35; 	/* uS */
+        unsigned char char_bits = ('n' == parity) ? 10 : 11;
+
 	this->slave = slave;
 	this->txenpin = txenpin;
 	
-        Serial.begin(baud);
+        cli();
+
+        /* USART0 at baud, double speed, as HardwareSerial sets it up */
+        UCSR0A = 1 << U2X0;
+        UBRR0 = (F_CPU / 4 / baud - 1) / 2;
+        UCSR0B = (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
+        UCSR0C = 0;
 
         switch (parity) {
         case 'e': // 8E1
@@ -515,9 +1001,36 @@ void ModbusSlave::configure(unsigned char slave, long baud, char parity, char tx
                 break;
         }
 
+        /* Timer1 counts in steps of 64 clocks; t1.5 and t3.5 are fixed */
+        /* above 19200 bps                                            */
+        if (baud > 19200) {
+                t15 = 750;
+                t35 = 1750;
+        } else {
+                t15 = char_bits * 1500000UL / baud;
+                t35 = char_bits * 3500000UL / baud;
+        }
+        TCCR1A = 0;
+        TCCR1B = (1 << CS11) | (1 << CS10);
+        OCR1B = t15 * (F_CPU / 1000000UL) / 64;
+        OCR1A = t35 * (F_CPU / 1000000UL) / 64;
+        TIMSK1 &= ~((1 << OCIE1A) | (1 << OCIE1B));
+
+        rx_slave = slave;
+        rx_count = 0;
+        rx_bad = rx_gap = 0;
+        tx_busy = 0;
+        frame_state = FRAME_FREE;
+
+        sei();
+
         if (txenpin > 1) { // pin 0 & pin 1 are reserved for RX/TX
                 pinMode(txenpin, OUTPUT);
                 digitalWrite(txenpin, LOW);
+                tx_en_port = portOutputRegister(digitalPinToPort(txenpin));
+                tx_en_mask = digitalPinToBitMask(txenpin);
+        } else {
+                tx_en_mask = 0;
         }
 
         return;
@@ -532,50 +1045,109 @@ void ModbusSlave::configure(unsigned char slave, long baud, char parity, char tx
  * 
  * regs: an array with the holding registers. They start at address 1 (master point of view)
  * regs_size: total number of holding registers, i.e. the size of the array regs.
+ * Coils, discrete inputs and input registers come from the tables set with
+ * set_coils(), set_inputs() and set_input_regs().
+ * A broadcast (slave 0) write is carried out without a reply; a broadcast
+ * read, or one the slave cannot carry out, is ignored.
  * returns: 0 if no request from master,
  * 	NO_REPLY (-1) if no reply is sent to the master
  * 	an exception code (1 to 4) in case of a modbus exceptions
  * 	the number of bytes sent as reply ( > 4) if OK.
+ * The reply goes out by interrupt after update() has returned.
  */
-unsigned long Nowdt = 0;
-unsigned int lastBytesReceived;
-const unsigned long T35 = 5;
-
 int ModbusSlave::update(int *regs,
 unsigned int regs_size) 
 {
-        unsigned char query[MAX_MESSAGE_LENGTH];
-        unsigned char errpacket[EXCEPTION_SIZE + CHECKSUM_SIZE];
-        unsigned int start_addr;
-        int exception;
-        int length = Serial.available();
-        unsigned long now = millis();
+        struct modbus_segment seg;
 
+        /* the array is a map of one segment, from address 0 */
+        seg.start = 0;
+        seg.length = regs_size;
+        seg.regs = regs;
+        seg.get = 0;
+        seg.set = 0;
 
-        if (length == 0) {
-                lastBytesReceived = 0;
-                return 0;
-        }
+        return update(&seg, 1);
+}
 
-        if (lastBytesReceived != length) {
-                lastBytesReceived = length;
-                Nowdt = now + T35;
-                return 0;
-        }
-        if (now < Nowdt) 
-                return 0;
+/*
+ * update()
+ *
+ * the same, with the holding registers in the map set with set_holding_map().
+ */
+int ModbusSlave::update(void) 
+{
+        return update(holding_map, holding_segments);
+}
+
+/*
+ * update(map, segments)
+ *
+ * the work of both: serves the request, if there is one, and frees the
+ * frame buffer.
+ */
+int ModbusSlave::update(const struct modbus_segment *map,
+unsigned char segments) 
+{
+        int status;
+
+        status = handle_request(frame, map, segments);
 
-        lastBytesReceived = 0;
+        /* unless the reply is going out of it, the buffer is free again */
+        cli();
+        if (!tx_busy && FRAME_BUSY == frame_state)
+                frame_state = FRAME_FREE;
+        sei();
+
+        return (status);
+}
+
+/*
+ * handle_request(query, map, segments)
+ *
+ * the work of update(), on the request in the frame buffer query. The
+ * reply is built over it.
+ */
+int ModbusSlave::handle_request(unsigned char *query,
+const struct modbus_segment *map, unsigned char segments) 
+{
+        unsigned int start_addr;
+        unsigned char on;
+        int exception;
+        int length;
 
         length = modbus_request(query);
         if (length < 1) 
                 return length;
          
-                exception = validate_request(query, length, regs_size);
+                exception = validate_request(query, length, map, segments);
+                if (BROADCAST == query[SLAVE]) {
+                        /* carry out the writes, never answer */
+                        if (exception)
+                                return NO_REPLY;
+                        start_addr =
+                                ((int) query[START_H] << 8) +
+                                (int) query[START_L];
+                        if (FC_WRITE_REGS == query[FUNC])
+                                put_regs(map, segments, start_addr,
+                                        query[REGS_L], query + BYTE_CNT + 1);
+                        else if (FC_WRITE_REG == query[FUNC])
+                                put_regs(map, segments, start_addr, 1,
+                                        query + REGS_H);
+                        else if (FC_WRITE_COILS == query[FUNC])
+                                put_bits(coils, start_addr,
+                                        ((int) query[REGS_H] << 8) + (int) query[REGS_L],
+                                        query + BYTE_CNT + 1);
+                        else if (FC_WRITE_COIL == query[FUNC]) {
+                                on = query[REGS_H] ? 1 : 0;
+                                put_bits(coils, start_addr, 1, &on);
+                        }
+                        return NO_REPLY;
+                }
                 if (exception) {
                         build_error_packet( query[FUNC], exception,
-                        errpacket);
-                        send_reply(errpacket, EXCEPTION_SIZE);
+                        query);
+                        send_reply(query, EXCEPTION_SIZE);
                         return (exception);
                 } 
 
@@ -584,27 +1156,77 @@ unsigned int regs_size)
                                 (int) query[START_L];
 
         switch (query[FUNC]) {
+                case FC_READ_COILS:
+                        return read_bits(
+                        FC_READ_COILS,
+                        start_addr,
+                        ((int) query[REGS_H] << 8) + (int) query[REGS_L],
+                        coils,
+                        query);
+                break;
+                case FC_READ_INPUTS:
+                        return read_bits(
+                        FC_READ_INPUTS,
+                        start_addr,
+                        ((int) query[REGS_H] << 8) + (int) query[REGS_L],
+                        inputs,
+                        query);
+                break;
                 case FC_READ_REGS:
-                        return read_holding_registers(
+                        return read_registers(
+                        FC_READ_REGS,
+                        start_addr,
+                        query[REGS_L],
+                        map,
+                        segments,
+                        query);
+                break;
+                case FC_READ_INPUT_REGS:
+                        return read_registers(
+                        FC_READ_INPUT_REGS,
                         start_addr,
                         query[REGS_L],
-                        regs);
+                        input_map,
+                        input_segments,
+                        query);
+                break;
+                case FC_WRITE_COIL:
+                        return force_single_coil(
+                        start_addr,
+                        query);
+                break;
+                case FC_WRITE_COILS:
+                        return force_multiple_coils(
+                        start_addr,
+                        ((int) query[REGS_H] << 8) + (int) query[REGS_L],
+                        query);
                 break;
                 case FC_WRITE_REGS:
                         return preset_multiple_registers(
                         start_addr,
                         query[REGS_L],
                         query,
-                        regs);
+                        map,
+                        segments);
+                break;
+                case FC_READ_WRITE_REGS:
+                        return read_write_registers(
+                        start_addr,
+                        query[REGS_L],
+                        query,
+                        map,
+                        segments);
                 break;
                 case FC_WRITE_REG:
-                        write_single_register(
+                        return write_single_register(
                         start_addr,
                         query,
-                        regs);
+                        map,
+                        segments);
                 break;                                
         }      
         
+        return NO_REPLY;
 }
 
 
@@ -2,26 +2,77 @@
 #define MODBUS_SLAVE_H
 #include "WProgram.h"
 
+/*
+ * RAM
+ *
+ * The slave keeps one 256 byte frame buffer, which holds the request as it
+ * comes in and the reply built over it, and 14 bytes of receiver and
+ * transmitter state: 270 bytes of static RAM in all, and 26 more for a
+ * ModbusSlave. update() keeps no buffer on the stack; at its deepest
+ * (update, handle_request, read_write_registers, send_reply, modbus_reply,
+ * crc) and with an interrupt on top, it needs roughly 100 to 150 bytes of
+ * stack, depending on the compiler. The rest of the 2 KB of an ATmega328,
+ * less what the Arduino core takes, is for the register tables and the
+ * sketch. Coils and inputs take a bit each, registers 2 bytes, and a
+ * register map 10 bytes a segment.
+ */
+
+/*
+ * struct modbus_segment
+ *
+ * one run of registers of a register map, from address start (0 based, as
+ * on the wire: register 40001 is 0) for length registers. They are kept in
+ * regs, regs[0] at start; or, if regs is 0, read with get() and written
+ * with set(), which are passed the register's address. A segment without
+ * set() cannot be written, one without get() cannot be read.
+ *
+ * A map is an array of segments sorted by start and not overlapping, so
+ * that a device with registers at 40001 and 41000 needs RAM only for the
+ * registers it has. A request may run from one segment into the next if
+ * there is no gap between them.
+ */
+struct modbus_segment {
+        unsigned int start;
+        unsigned int length;
+        int *regs;
+        int (*get)(unsigned int addr);
+        void (*set)(unsigned int addr, int value);
+};
+
 class ModbusSlave {
 private:
   unsigned char slave;
   char txenpin;
+  unsigned char *coils;		/* packed, coil 1 in bit 0 of coils[0] */
+  unsigned int coils_size;	/* in coils */
+  unsigned char *inputs;	/* packed like the coils */
+  unsigned int inputs_size;
+  struct modbus_segment input_seg;	/* the array of set_input_regs() */
+  const struct modbus_segment *input_map;
+  unsigned char input_segments;
+  const struct modbus_segment *holding_map;
+  unsigned char holding_segments;
 
   unsigned int crc(unsigned char *buf, unsigned char start, unsigned char cnt);
   void build_read_packet(unsigned char function, unsigned char count, unsigned char *packet);
-  void build_write_packet(unsigned char function, unsigned int start_addr, unsigned char count, unsigned char *packet);
+  void build_write_packet(unsigned char function, unsigned int start_addr, unsigned int count, unsigned char *packet);
   void build_write_single_packet(unsigned char function, unsigned int write_addr, unsigned int reg_val, unsigned char* packet);
   void build_error_packet(unsigned char function,unsigned char exception, unsigned char *packet);
   void modbus_reply(unsigned char *packet, unsigned char string_length);
   int send_reply(unsigned char *query, unsigned char string_length);
-  int receive_request(unsigned char *received_string);
+  int receive_request(void);
   int modbus_request(unsigned char *data);
-  int validate_request(unsigned char *data, unsigned char length, unsigned int regs_size);
-  int write_regs(unsigned int start_addr, unsigned char *query, int *regs);
-  int preset_multiple_registers(unsigned int start_addr,unsigned char count,unsigned char *query,int *regs);
-  int read_holding_registers(unsigned int start_addr, unsigned char reg_count, int *regs);
-  int write_single_register(unsigned int write_addr, unsigned char *query, int *regs);  
+  int validate_request(unsigned char *data, unsigned char length, const struct modbus_segment *map, unsigned char segments);
+  int preset_multiple_registers(unsigned int start_addr,unsigned char count,unsigned char *query,const struct modbus_segment *map, unsigned char segments);
+  int read_registers(unsigned char function, unsigned int start_addr, unsigned char reg_count, const struct modbus_segment *map, unsigned char segments, unsigned char *packet);
+  int read_bits(unsigned char function, unsigned int start_addr, unsigned int bit_count, unsigned char *bits, unsigned char *packet);
+  int force_single_coil(unsigned int coil_addr, unsigned char *query);
+  int force_multiple_coils(unsigned int start_addr, unsigned int coil_count, unsigned char *query);
+  int write_single_register(unsigned int write_addr, unsigned char *query, const struct modbus_segment *map, unsigned char segments);  
+  int read_write_registers(unsigned int start_addr, unsigned char reg_count, unsigned char *query, const struct modbus_segment *map, unsigned char segments);
   void configure(long baud, char parity, char txenpin);
+  int update(const struct modbus_segment *map, unsigned char segments);
+  int handle_request(unsigned char *query, const struct modbus_segment *map, unsigned char segments);
   
 public:
 /* 
@@ -37,9 +88,39 @@ public:
  *        of an external half-duplex device (e.g. a RS485 interface chip).
  *        0 or 1 disables this function (for a two-device network)
  *        >2 for point-to-multipoint topology (e.g. several arduinos)
+ *
+ * The slave takes over USART0 and Timer1: frames are received by interrupt
+ * and ended by Timer1 at t3.5, so the sketch must not use Serial, nor
+ * anything else that needs Timer1 (PWM on pins 9 and 10, Servo).
  */
   void configure(unsigned char slave, long baud, char parity, char txenpin);
 
+/*
+ * set_coils(coils, coils_size)  set_inputs(inputs, inputs_size)
+ * set_input_regs(input_regs, input_regs_size)
+ *
+ * hand the slave its coil, discrete input and input register tables, for
+ * FC01/05/15, FC02 and FC04. Coils and inputs are packed eight to a byte,
+ * coil 1 (master point of view) in the lowest bit of the first byte; an
+ * array of (n + 7) / 8 bytes holds n of them. The sizes are in coils,
+ * inputs and registers. A table that is not set has size 0, and requests
+ * for it get an address exception.
+ */
+  void set_coils(unsigned char *coils, unsigned int coils_size);
+  void set_inputs(unsigned char *inputs, unsigned int inputs_size);
+  void set_input_regs(int *input_regs, unsigned int input_regs_size);
+
+/*
+ * set_input_map(map, segments)  set_holding_map(map, segments)
+ *
+ * hand the slave a register map (see struct modbus_segment) of segments
+ * segments for its input registers (FC04), in place of set_input_regs(),
+ * or for its holding registers (FC03/06/16/23), served by update().
+ * The map is used where it is, and must stay.
+ */
+  void set_input_map(const struct modbus_segment *map, unsigned char segments);
+  void set_holding_map(const struct modbus_segment *map, unsigned char segments);
+
 /*
  * update(regs, regs_size)
  * 
@@ -48,17 +129,33 @@ public:
  * 
  * regs: an array with the holding registers. They start at address 1 (master point of view)
  * regs_size: total number of holding registers, i.e. the size of the array regs.
+ * Coils, discrete inputs and input registers come from the tables set with
+ * set_coils(), set_inputs() and set_input_regs().
+ * A broadcast (slave 0) write is carried out without a reply; a broadcast
+ * read, or one the slave cannot carry out, is ignored.
  * returns: 0 if no request from master,
  * 	NO_REPLY (-1) if no reply is sent to the master
  * 	an exception code (1 to 4) in case of a modbus exceptions
  * 	the number of bytes sent as reply ( > 4) if OK.
+ * The reply goes out by interrupt after update() has returned.
  */
   int update(int *regs, unsigned int regs_size); 
 
-  // empty constructor
+/*
+ * update()
+ *
+ * the same, with the holding registers in the map set with
+ * set_holding_map(); all of them get an address exception if it is not set.
+ */
+  int update(void);
+
+  // no coil, input or register tables until they are set
   ModbusSlave()
   {
-  
+        coils = inputs = 0;
+        coils_size = inputs_size = 0;
+        input_map = holding_map = 0;
+        input_segments = holding_segments = 0;
   }
 
 };
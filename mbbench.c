@@ -0,0 +1,460 @@
+/* mbbench.c
+
+   End to end benchmark of the master calls against mbsim.
+
+   Usage: mbbench [-m mbsim] [-d device] [-b bauds] [-f functions]
+		  [-r reg_counts] [-c coil_counts] [-n txns] [-T secs] [-j]
+
+	e.g.  mbbench -b 9600,115200 -f 3,16 -r 1,125 > bench.csv
+
+   For every baud rate mbsim is started on a fresh pty (or -d names a
+   port with a real slave 1 on it), and every function code is timed
+   for every count of its list: registers for FC03, 04 and 16, coils
+   for FC01, 02 and 15, one for FC05 and 06. A point stops after txns
+   transactions or secs seconds, whichever comes first.
+
+   One line per point, CSV or with -j JSON, on stdout:
+
+	fc, count, baud, txns, errors, tps, and the mean, p50, p99 and
+	p999 round trip in uS, wire_us, efficiency
+
+   wire_us is the least a transaction can take on the line: query
+   and reply at the character time of the baud rate plus the two
+   t3.5 gaps, after the query and before the next one. efficiency is
+   wire_us over the mean round trip. Failed transactions count as
+   errors and are left out of the times.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "modbus_rtu.h"
+
+#define MAX_LIST 16
+#define SLAVE 1
+#define START_ADDR 1
+
+#define DEFAULT_BAUDS "9600,19200,115200,921600"
+#define DEFAULT_FUNCTIONS "1,2,3,4,5,6,15,16"
+#define DEFAULT_REGS "1,10,50,100"
+#define DEFAULT_COILS "1,80,400,800"
+
+struct bench_point {
+	int function;
+	int count;
+	int baud;
+	long txns;
+	long errors;
+	double secs;		/* wall time of the point */
+	long *ns;		/* round trip of each good transaction */
+	long wire_ns;
+};
+
+static uint16_t regs16[MAX_PDU_READ_REGS];
+static unsigned char bits[MAX_PDU_READ_BITS / 8 + 1];
+static int json, first_line = 1;
+
+
+
+
+static long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000L + ts.tv_nsec);
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *) a, y = *(const long *) b;
+
+	return ((x > y) - (x < y));
+}
+
+static int parse_list(char *arg, int *list)
+{
+	char *tok;
+	int n = 0;
+
+	for (tok = strtok(arg, ","); tok && n < MAX_LIST;
+	     tok = strtok(NULL, ","))
+		list[n++] = atoi(tok);
+	return (n);
+}
+
+
+
+
+/*************************************************************************
+
+	wire_length
+
+	bytes of the query and of the reply of a transaction, CRC
+	included.
+
+**************************************************************************/
+
+static void wire_length(int function, int count, int *query, int *reply)
+{
+	switch (function) {
+	case 0x01:
+	case 0x02:
+		*query = 8;
+		*reply = 5 + (count + 7) / 8;
+		break;
+	case 0x03:
+	case 0x04:
+		*query = 8;
+		*reply = 5 + 2 * count;
+		break;
+	case 0x0F:
+		*query = 9 + (count + 7) / 8;
+		*reply = 8;
+		break;
+	case 0x10:
+		*query = 9 + 2 * count;
+		*reply = 8;
+		break;
+	default:
+		*query = *reply = 8;
+	}
+}
+
+/* the largest count the call of a function takes */
+static int max_count(int function)
+{
+	switch (function) {
+	case 0x01:
+	case 0x02:
+		return (MAX_PDU_READ_BITS);
+	case 0x03:
+		return (MAX_READ_REGS);
+	case 0x04:
+		return (MAX_INPUT_REGS);
+	case 0x0F:
+		return (MAX_WRITE_COILS);
+	case 0x10:
+		return (MAX_WRITE_REGS);
+	default:
+		return (1);
+	}
+}
+
+
+
+
+/* one transaction; > 0 if it went through */
+static int transaction(int function, int count, long n, int fd)
+{
+	switch (function) {
+	case 0x01:
+		return (read_coil_status_packed(SLAVE, START_ADDR, count,
+						bits, sizeof(bits), fd));
+	case 0x02:
+		return (read_input_status_packed(SLAVE, START_ADDR, count,
+						 bits, sizeof(bits), fd));
+	case 0x03:
+		return (read_holding_registers16(SLAVE, START_ADDR, count,
+						 regs16, count, fd));
+	case 0x04:
+		return (read_input_registers16(SLAVE, START_ADDR, count,
+					       regs16, count, fd));
+	case 0x05:
+		return (force_single_coil(SLAVE, START_ADDR, n & 1, fd));
+	case 0x06:
+		return (preset_single_register(SLAVE, START_ADDR, n & 0xFFFF,
+					       fd));
+	case 0x0F:
+		bits[0] = n;
+		return (set_multiple_coils_packed(SLAVE, START_ADDR, count,
+						  bits, fd));
+	case 0x10:
+		regs16[0] = n;
+		return (preset_multiple_registers16(SLAVE, START_ADDR, count,
+						    regs16, fd));
+	default:
+		return (-1);
+	}
+}
+
+
+
+
+static void run_point(struct bench_point *p, int max_txns, double budget,
+		      int fd)
+{
+	struct modbus_timing t;
+	int query, reply;
+	long start, end, t0, t1, good = 0;
+
+	compute_char_timing(p->baud, 10, &t);
+	wire_length(p->function, p->count, &query, &reply);
+	p->wire_ns = (query + reply) * t.char_ns + 2 * t.t35 * 1000L;
+
+	start = now_ns();
+	end = start + (long) (budget * 1e9);
+	for (p->txns = 0, p->errors = 0; p->txns < max_txns; p->txns++) {
+		t0 = now_ns();
+		if (transaction(p->function, p->count, p->txns, fd) > 0) {
+			t1 = now_ns();
+			p->ns[good++] = t1 - t0;
+		} else {
+			t1 = now_ns();
+			p->errors++;
+		}
+		if (t1 >= end) {
+			p->txns++;
+			break;
+		}
+	}
+	p->secs = (now_ns() - start) / 1e9;
+	qsort(p->ns, good, sizeof(long), cmp_long);
+}
+
+/* the p-th fraction of the sorted times, in uS */
+static double percentile(struct bench_point *p, double frac)
+{
+	long good = p->txns - p->errors;
+	long i = (long) (frac * good + 0.999999) - 1;
+
+	if (good == 0)
+		return (0);
+	if (i < 0)
+		i = 0;
+	return (p->ns[i] / 1000.0);
+}
+
+static void print_point(struct bench_point *p)
+{
+	long good = p->txns - p->errors;
+	double mean = 0, tps = p->txns / p->secs;
+	long i;
+
+	for (i = 0; i < good; i++)
+		mean += p->ns[i];
+	mean = good ? mean / good / 1000.0 : 0;
+
+	if (json) {
+		printf("%s{\"fc\": %d, \"count\": %d, \"baud\": %d, "
+		       "\"txns\": %ld, \"errors\": %ld, \"tps\": %.1f, "
+		       "\"mean_us\": %.1f, \"p50_us\": %.1f, "
+		       "\"p99_us\": %.1f, \"p999_us\": %.1f, "
+		       "\"wire_us\": %.1f, \"efficiency\": %.3f}",
+		       first_line ? "[\n  " : ",\n  ", p->function, p->count,
+		       p->baud, p->txns, p->errors, tps, mean,
+		       percentile(p, 0.50), percentile(p, 0.99),
+		       percentile(p, 0.999), p->wire_ns / 1000.0,
+		       mean > 0 ? p->wire_ns / 1000.0 / mean : 0);
+	} else {
+		if (first_line)
+			printf("fc,count,baud,txns,errors,tps,mean_us,p50_us,"
+			       "p99_us,p999_us,wire_us,efficiency\n");
+		printf("%d,%d,%d,%ld,%ld,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.3f\n",
+		       p->function, p->count, p->baud, p->txns, p->errors,
+		       tps, mean, percentile(p, 0.50), percentile(p, 0.99),
+		       percentile(p, 0.999), p->wire_ns / 1000.0,
+		       mean > 0 ? p->wire_ns / 1000.0 / mean : 0);
+	}
+	first_line = 0;
+	fflush(stdout);
+}
+
+
+
+
+/*************************************************************************
+
+	start_sim
+
+	runs mbsim for one slave at baud and returns its pid; the pty
+	path it prints goes to path.
+
+**************************************************************************/
+
+static pid_t start_sim(const char *sim, int baud, char *path, int size)
+{
+	char baud_arg[16];
+	int pipefd[2];
+	FILE *out;
+	pid_t pid;
+
+	if (pipe(pipefd) < 0)
+		return (-1);
+	snprintf(baud_arg, sizeof(baud_arg), "%d", baud);
+
+	pid = fork();
+	if (pid == 0) {
+		dup2(pipefd[1], 1);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		execl(sim, sim, "-b", baud_arg, "-s", "1", (char *) NULL);
+		_exit(127);
+	}
+	close(pipefd[1]);
+	if (pid < 0) {
+		close(pipefd[0]);
+		return (-1);
+	}
+
+	out = fdopen(pipefd[0], "r");
+	if (!out || !fgets(path, size, out)) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return (-1);
+	}
+	path[strcspn(path, "\n")] = 0;
+	fclose(out);
+	return (pid);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: mbbench [-m mbsim] [-d device] [-b bauds] "
+		"[-f functions]\n"
+		"               [-r reg_counts] [-c coil_counts] [-n txns] "
+		"[-T secs] [-j]\n");
+	exit(1);
+}
+
+
+
+
+int main(int argc, char *argv[])
+{
+	char baud_list[64] = DEFAULT_BAUDS, fn_list[64] = DEFAULT_FUNCTIONS;
+	char reg_list[64] = DEFAULT_REGS, coil_list[64] = DEFAULT_COILS;
+	char *sim = "./mbsim", *device = NULL;
+	char path[256];
+	int bauds[MAX_LIST], functions[MAX_LIST];
+	int reg_counts[MAX_LIST], coil_counts[MAX_LIST];
+	int n_bauds, n_functions, n_regs, n_coils;
+	int max_txns = 1000, opt, b, f, c, n, *counts, fd;
+	double budget = 1.0;
+	struct bench_point p;
+	pid_t pid = 0;
+
+	while ((opt = getopt(argc, argv, "m:d:b:f:r:c:n:T:j")) != -1) {
+		switch (opt) {
+		case 'm':
+			sim = optarg;
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 'b':
+			snprintf(baud_list, sizeof(baud_list), "%s", optarg);
+			break;
+		case 'f':
+			snprintf(fn_list, sizeof(fn_list), "%s", optarg);
+			break;
+		case 'r':
+			snprintf(reg_list, sizeof(reg_list), "%s", optarg);
+			break;
+		case 'c':
+			snprintf(coil_list, sizeof(coil_list), "%s", optarg);
+			break;
+		case 'n':
+			max_txns = atoi(optarg);
+			break;
+		case 'T':
+			budget = atof(optarg);
+			break;
+		case 'j':
+			json = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || max_txns < 1)
+		usage();
+
+	n_bauds = parse_list(baud_list, bauds);
+	n_functions = parse_list(fn_list, functions);
+	n_regs = parse_list(reg_list, reg_counts);
+	n_coils = parse_list(coil_list, coil_counts);
+
+	p.ns = malloc(max_txns * sizeof(long));
+	if (!p.ns) {
+		fprintf(stderr, "mbbench: out of memory\n");
+		return 1;
+	}
+
+	for (b = 0; b < n_bauds; b++) {
+		if (device) {
+			snprintf(path, sizeof(path), "%s", device);
+		} else if ((pid = start_sim(sim, bauds[b], path,
+					    sizeof(path))) < 0) {
+			fprintf(stderr, "mbbench: cannot run %s\n", sim);
+			return 1;
+		}
+		fd = set_up_comms(path, bauds[b], "none");
+
+		for (f = 0; f < n_functions; f++) {
+			switch (functions[f]) {
+			case 0x01:
+			case 0x02:
+			case 0x0F:
+				counts = coil_counts;
+				n = n_coils;
+				break;
+			case 0x03:
+			case 0x04:
+			case 0x10:
+				counts = reg_counts;
+				n = n_regs;
+				break;
+			case 0x05:
+			case 0x06:
+				counts = NULL;
+				n = 1;
+				break;
+			default:
+				fprintf(stderr, "mbbench: FC%d not covered\n",
+					functions[f]);
+				continue;
+			}
+
+			for (c = 0; c < n; c++) {
+				p.function = functions[f];
+				p.count = counts ? counts[c] : 1;
+				if (p.count < 1
+				    || p.count > max_count(p.function))
+					continue;
+				p.baud = bauds[b];
+				run_point(&p, max_txns, budget, fd);
+				print_point(&p);
+			}
+		}
+
+		close_comms(fd);
+		if (pid > 0) {
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+		}
+	}
+
+	if (json)
+		printf(first_line ? "[]\n" : "\n]\n");
+	return 0;
+}
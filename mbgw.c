@@ -0,0 +1,672 @@
+/* mbgw.c
+
+   Modbus TCP to RTU gateway.
+
+   Usage: mbgw [-l tcp_port] [-t timeout_ms] device:baud:parity:units ...
+
+	e.g.  mbgw -l 1502 /dev/ttyUSB0:19200:even:1-32 /dev/ttyUSB1:9600:none:40
+
+   Every bus is given the unit IDs it serves, a range or a single ID.
+   A TCP request for a unit nobody serves gets exception 0x0A (gateway
+   path unavailable), one the slave does not answer exception 0x0B.
+
+   All buses and all clients are served by one thread. The rtu_loop
+   of the buses is itself an epoll fd, so it sits in the epoll set of
+   the gateway next to the listening socket and the clients. Each bus
+   has one transaction on the wire; the clients with requests for it
+   are served round robin, one request each, so a busy client cannot
+   starve the others. Replies carry the transaction ID of their
+   request and go back to the client that sent it.
+
+   Idle clients cost one struct gw_client each; raise the open file
+   limit (ulimit -n) for more than about 1000 of them.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#define _GNU_SOURCE		/* accept4() */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "modbus_rtu.h"
+#include "modbus_loop.h"
+
+#define DEFAULT_TCP_PORT 502
+#define MAX_BUSES 8
+#define MAX_REQUESTS 4096	/* queued or on the wire, all clients */
+#define CLIENT_MAX_PENDING 32	/* per client; more get exception 0x06 */
+#define MAX_EVENTS 256
+
+#define MBAP_SIZE 7		/* tid, protocol, length, unit */
+#define MAX_ADU_LENGTH 260
+#define IN_BUF_SIZE (2 * MAX_ADU_LENGTH)
+#define OUT_BUF_SIZE (16 * MAX_ADU_LENGTH)
+
+#define EXC_SLAVE_BUSY 0x06
+#define EXC_PATH_UNAVAILABLE 0x0A
+#define EXC_TARGET_FAILED 0x0B
+
+enum {
+	WATCH_LISTEN,
+	WATCH_CLIENT,
+	WATCH_LOOP
+};
+
+struct gw_watch {
+	int kind;
+	void *ptr;
+};
+
+struct gw_client;
+
+struct gw_request {
+	struct rtu_txn txn;
+	struct gw_client *client;	/* NULL once the client has gone */
+	struct gw_bus *bus;
+	int tid;
+	struct gw_request *next;
+};
+
+struct gw_client {
+	int fd;
+	struct gw_watch watch;
+	unsigned char in[IN_BUF_SIZE];
+	int in_len;
+	unsigned char out[OUT_BUF_SIZE];
+	int out_len;
+	int want_out;		/* EPOLLOUT is on */
+	int pending;
+	struct gw_request *head[MAX_BUSES], *tail[MAX_BUSES];
+	struct gw_client *ring_next[MAX_BUSES];	/* NULL if not waiting */
+	struct gw_client *next_closed;
+};
+
+struct gw_bus {
+	struct rtu_bus bus;
+	int index;
+	struct gw_request *active;	/* on the wire */
+	struct gw_client *ring;	/* last client served; next is the */
+				/* one after it                     */
+};
+
+static struct gw_bus buses[MAX_BUSES];
+static int n_buses;
+static signed char unit_bus[256];	/* -1 if no bus serves it */
+
+static struct gw_request requests[MAX_REQUESTS];
+static struct gw_request *free_requests;
+
+static struct gw_client *closed_clients;	/* freed after each round */
+
+static struct rtu_loop loop;
+static int epfd;
+static long reply_timeout = 1000000;	/* uS */
+
+
+
+
+/************************************************************************
+
+	client output
+
+	replies are written at once; whatever the socket does not take
+	is kept and sent when it is writable again.
+
+*************************************************************************/
+
+static void close_client(struct gw_client *c);
+
+static void set_want_out(struct gw_client *c, int on)
+{
+	struct epoll_event ev;
+
+	if (c->want_out == on)
+		return;
+	c->want_out = on;
+	ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+	ev.data.ptr = &c->watch;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static int flush_client(struct gw_client *c)
+{
+	int n;
+
+	while (c->out_len > 0) {
+		n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0)
+			return (-1);
+		memmove(c->out, c->out + n, c->out_len - n);
+		c->out_len -= n;
+	}
+	set_want_out(c, c->out_len > 0);
+	return (0);
+}
+
+/* one MBAP framed reply: tid, protocol 0, length, then unit + pdu */
+static void send_reply(struct gw_client *c, int tid, unsigned char *adu,
+		       int length)
+{
+	unsigned char *p;
+
+	if (c->out_len + MBAP_SIZE - 1 + length > OUT_BUF_SIZE) {
+		close_client(c);	/* not reading its replies */
+		return;
+	}
+
+	p = c->out + c->out_len;
+	p[0] = tid >> 8;
+	p[1] = tid & 0xFF;
+	p[2] = 0;
+	p[3] = 0;
+	p[4] = length >> 8;
+	p[5] = length & 0xFF;
+	memcpy(p + 6, adu, length);
+	c->out_len += 6 + length;
+
+	if (flush_client(c) < 0)
+		close_client(c);
+}
+
+static void send_exception(struct gw_client *c, int tid, int unit,
+			   int function, int code)
+{
+	unsigned char adu[3];
+
+	adu[0] = unit;
+	adu[1] = function | 0x80;
+	adu[2] = code;
+	send_reply(c, tid, adu, 3);
+}
+
+
+
+
+/************************************************************************
+
+	bus scheduling
+
+	the clients waiting for a bus form a ring; bus->ring is the one
+	served last, so a newcomer is put right behind it and gets its
+	turn after everyone already waiting.
+
+*************************************************************************/
+
+static void request_done(struct rtu_txn *txn, int status);
+
+static void serve_next(struct gw_bus *b)
+{
+	struct gw_client *prev, *c;
+	struct gw_request *req;
+	int i = b->index;
+
+	if (b->active || !b->ring)
+		return;
+
+	prev = b->ring;
+	c = prev->ring_next[i];
+
+	req = c->head[i];
+	c->head[i] = req->next;
+	if (!c->head[i]) {
+		c->tail[i] = NULL;
+		/* nothing more from c, take it out of the ring */
+		if (c == prev) {
+			b->ring = NULL;
+		} else {
+			prev->ring_next[i] = c->ring_next[i];
+		}
+		c->ring_next[i] = NULL;
+	} else {
+		b->ring = c;
+	}
+
+	req->next = NULL;
+	b->active = req;
+	rtu_bus_submit(&b->bus, &req->txn);
+}
+
+static void queue_request(struct gw_bus *b, struct gw_client *c,
+			  struct gw_request *req)
+{
+	int i = b->index;
+
+	req->next = NULL;
+	if (c->tail[i])
+		c->tail[i]->next = req;
+	else
+		c->head[i] = req;
+	c->tail[i] = req;
+
+	if (!c->ring_next[i]) {
+		if (b->ring) {
+			c->ring_next[i] = b->ring->ring_next[i];
+			b->ring->ring_next[i] = c;
+		} else {
+			c->ring_next[i] = c;
+		}
+		b->ring = c;
+	}
+
+	serve_next(b);
+}
+
+
+
+
+/************************************************************************
+
+	request_done
+
+	called by the loop; turns the RTU reply into a TCP one.
+
+*************************************************************************/
+
+static void request_done(struct rtu_txn *txn, int status)
+{
+	struct gw_request *req = txn->arg;
+	struct gw_client *c = req->client;
+	struct gw_bus *b = req->bus;
+
+	b->active = NULL;
+
+	if (c) {
+		c->pending--;
+		if (status > 0)
+			send_reply(c, req->tid, txn->response, status - 2);
+		else if (txn->response_length >= 3
+			 && txn->response[1] == (txn->query[1] | 0x80))
+			send_exception(c, req->tid, txn->query[0],
+				       txn->query[1], txn->response[2]);
+		else
+			send_exception(c, req->tid, txn->query[0],
+				       txn->query[1], EXC_TARGET_FAILED);
+	}
+
+	req->next = free_requests;
+	free_requests = req;
+
+	serve_next(b);
+}
+
+
+
+
+/************************************************************************
+
+	handle_adu
+
+	one complete MBAP frame from a client.
+
+*************************************************************************/
+
+static void handle_adu(struct gw_client *c, unsigned char *adu, int length)
+{
+	struct gw_request *req;
+	int tid = (adu[0] << 8) | adu[1];
+	int unit = adu[6];
+	int function = adu[7];
+	int pdu_length = length - MBAP_SIZE;
+
+	if (unit_bus[unit] < 0) {
+		send_exception(c, tid, unit, function, EXC_PATH_UNAVAILABLE);
+		return;
+	}
+	if (c->pending >= CLIENT_MAX_PENDING || !free_requests) {
+		send_exception(c, tid, unit, function, EXC_SLAVE_BUSY);
+		return;
+	}
+
+	req = free_requests;
+	free_requests = req->next;
+
+	req->client = c;
+	req->bus = &buses[unit_bus[unit]];
+	req->tid = tid;
+	req->txn.query[0] = unit;
+	memcpy(req->txn.query + 1, adu + MBAP_SIZE, pdu_length);
+	req->txn.query_length = 1 + pdu_length;
+	req->txn.timeout = reply_timeout;
+	req->txn.done = request_done;
+	req->txn.arg = req;
+
+	c->pending++;
+	queue_request(req->bus, c, req);
+}
+
+
+
+
+/************************************************************************
+
+	client input
+
+	reads what is there and handles every complete frame. A frame
+	that is not Modbus TCP closes the connection.
+
+*************************************************************************/
+
+static void read_client(struct gw_client *c)
+{
+	int n, length, used;
+
+	for (;;) {
+		n = recv(c->fd, c->in + c->in_len, IN_BUF_SIZE - c->in_len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0) {
+			close_client(c);
+			return;
+		}
+		c->in_len += n;
+
+		used = 0;
+		while (c->in_len - used >= MBAP_SIZE + 1) {
+			unsigned char *adu = c->in + used;
+
+			length = (adu[4] << 8) | adu[5];
+			if (adu[2] || adu[3] || length < 2
+			    || length > MAX_ADU_LENGTH - 6) {
+				close_client(c);
+				return;
+			}
+			if (c->in_len - used < 6 + length)
+				break;
+			handle_adu(c, adu, 6 + length);
+			if (c->fd < 0)
+				return;
+			used += 6 + length;
+		}
+		memmove(c->in, c->in + used, c->in_len - used);
+		c->in_len -= used;
+	}
+}
+
+
+
+
+/************************************************************************
+
+	close_client
+
+	drops its queued requests. A request on the wire finishes,
+	but its reply is thrown away. The client itself is freed at the
+	end of the round of events, which may still mention it.
+
+*************************************************************************/
+
+static void close_client(struct gw_client *c)
+{
+	struct gw_request *req, *next;
+	struct gw_client *p;
+	struct gw_bus *b;
+	int i;
+
+	if (c->fd < 0)
+		return;
+
+	for (i = 0; i < n_buses; i++) {
+		b = &buses[i];
+		if (b->active && b->active->client == c)
+			b->active->client = NULL;
+
+		for (req = c->head[i]; req; req = next) {
+			next = req->next;
+			req->next = free_requests;
+			free_requests = req;
+		}
+
+		if (c->ring_next[i]) {
+			for (p = c; p->ring_next[i] != c; p = p->ring_next[i]);
+			if (p == c) {
+				b->ring = NULL;
+			} else {
+				p->ring_next[i] = c->ring_next[i];
+				if (b->ring == c)
+					b->ring = p;
+			}
+		}
+	}
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->next_closed = closed_clients;
+	closed_clients = c;
+}
+
+
+
+
+/************************************************************************
+
+	accept_clients
+
+*************************************************************************/
+
+static void accept_clients(int listen_fd)
+{
+	struct epoll_event ev;
+	struct gw_client *c;
+	int fd, one = 1;
+
+	while ((fd = accept4(listen_fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c->fd = fd;
+		c->watch.kind = WATCH_CLIENT;
+		c->watch.ptr = c;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &c->watch;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			free(c);
+		}
+	}
+}
+
+
+
+
+/************************************************************************
+
+	add_bus
+
+	device:baud:parity:units, units being first-last or one ID.
+
+*************************************************************************/
+
+static int add_bus(char *spec)
+{
+	char *device, *baud, *parity, *units, *dash;
+	int first, last, unit, fd;
+	struct gw_bus *b;
+
+	device = strtok(spec, ":");
+	baud = strtok(NULL, ":");
+	parity = strtok(NULL, ":");
+	units = strtok(NULL, ":");
+	if (!device || !baud || !parity || !units || n_buses >= MAX_BUSES)
+		return (-1);
+
+	first = atoi(units);
+	dash = strchr(units, '-');
+	last = dash ? atoi(dash + 1) : first;
+	if (first < 1 || last > 255 || first > last)
+		return (-1);
+
+	b = &buses[n_buses];
+	fd = set_up_comms(device, atoi(baud), parity);
+	if (rtu_bus_add(&loop, &b->bus, fd) < 0) {
+		close_comms(fd);
+		return (-1);
+	}
+	b->index = n_buses;
+
+	for (unit = first; unit <= last; unit++)
+		unit_bus[unit] = n_buses;
+	n_buses++;
+
+	return (0);
+}
+
+static int open_listener(int port)
+{
+	struct sockaddr_in addr;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return (-1);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+	    || listen(fd, 1024) < 0) {
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: mbgw [-l tcp_port] [-t timeout_ms] "
+		"device:baud:parity:first[-last] ...\n");
+	exit(1);
+}
+
+
+
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct gw_watch listen_watch, loop_watch;
+	struct gw_watch *watch;
+	struct gw_client *c;
+	int port = DEFAULT_TCP_PORT;
+	int listen_fd, opt, i, n;
+
+	memset(unit_bus, -1, sizeof(unit_bus));
+	for (i = 0; i < MAX_REQUESTS; i++) {
+		requests[i].next = free_requests;
+		free_requests = &requests[i];
+	}
+
+	if (rtu_loop_init(&loop) < 0) {
+		fprintf(stderr, "mbgw: no epoll\n");
+		return 1;
+	}
+
+	while ((opt = getopt(argc, argv, "l:t:")) != -1) {
+		switch (opt) {
+		case 'l':
+			port = atoi(optarg);
+			break;
+		case 't':
+			reply_timeout = atol(optarg) * 1000L;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc)
+		usage();
+	for (i = optind; i < argc; i++) {
+		if (add_bus(argv[i]) < 0) {
+			fprintf(stderr, "mbgw: bad bus %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	listen_fd = open_listener(port);
+	if (listen_fd < 0) {
+		fprintf(stderr, "mbgw: cannot listen on port %d\n", port);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	listen_watch.kind = WATCH_LISTEN;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_watch;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	loop_watch.kind = WATCH_LOOP;
+	ev.data.ptr = &loop_watch;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, loop.epfd, &ev);
+
+	for (;;) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		if (n < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < n; i++) {
+			watch = events[i].data.ptr;
+			switch (watch->kind) {
+			case WATCH_LISTEN:
+				accept_clients(listen_fd);
+				break;
+			case WATCH_LOOP:
+				rtu_loop_dispatch(&loop, 0);
+				break;
+			case WATCH_CLIENT:
+				c = watch->ptr;
+				if (c->fd < 0)
+					break;
+				if (events[i].events & EPOLLOUT
+				    && flush_client(c) < 0)
+					close_client(c);
+				if (c->fd >= 0 && events[i].events
+				    & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					read_client(c);
+				break;
+			}
+		}
+
+		while ((c = closed_clients)) {
+			closed_clients = c->next_closed;
+			free(c);
+		}
+	}
+
+	return 1;
+}
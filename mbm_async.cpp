@@ -0,0 +1,62 @@
+#include "modbus_async.h"
+#include <stdio.h>
+
+#define COMM_PORT		"/dev/ttyUSB0"
+#define COMM_PARITY		"even"
+
+/* Modbus RTU common parameters, the Slave MUST use the same parameters */
+enum {
+        COMM_BPS = 115200,
+        MB_SLAVE = 1,	/* modbus slave id */
+};
+/* slave 1 registers */
+enum {
+        MB_CTRL,        /* Led control on, off or blink */
+        MB_TIME,        /* blink time in milliseconds */
+        MB_CNT,        /* count the number of blinks */
+        MB_REGS	 	/* total number of registers on slave */
+};
+
+/* set the led blinking, then read the blink count a few times */
+static ModbusTask blink(ModbusMaster &master)
+{
+	int regs[MB_REGS];
+	int i, err;
+
+	regs[MB_CTRL] = 2;
+	regs[MB_TIME] = 200;
+	err = co_await master.preset_registers(MB_SLAVE, (MB_CTRL+1), 2, regs);
+	if (err <= 0)
+		fprintf(stderr, "preset failed: %d\n", err);
+
+	for (i = 0; i < 5; i++) {
+		err = co_await master.read_holding(MB_SLAVE, (MB_CTRL+1),
+						   MB_REGS, regs, MB_REGS);
+		if (err > 0)
+			printf("\n The blink count at this time is %d \n\n",
+			       regs[MB_CNT]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct rtu_loop loop;
+	struct rtu_bus bus;
+	int fd = set_up_comms((char *) COMM_PORT, COMM_BPS,
+			      (char *) COMM_PARITY);
+
+	if (rtu_loop_init(&loop) < 0 || rtu_bus_add(&loop, &bus, fd) < 0) {
+		fprintf(stderr, "cannot set up the event loop\n");
+		return 1;
+	}
+
+	ModbusMaster master(&bus);
+
+	blink(master);
+	rtu_loop_run(&loop);
+
+	rtu_bus_remove(&bus);
+	rtu_loop_close(&loop);
+
+	return 0;
+}
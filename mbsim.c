@@ -0,0 +1,713 @@
+/* mbsim.c
+
+   Virtual Modbus RTU slaves on a pseudo terminal.
+
+   Usage: mbsim [-b baud] [-p parity] [-s first[-last]] [-n map_size]
+		[-f map_file] [-d latency_us] [-D slave=latency_us]
+		[-c crc_%] [-x drop_%] [-e exception_%] [-q slave]
+		[-S seed] [-L link]
+
+	e.g.  mbsim -b 115200 -s 1-32 -d 500 -L /tmp/ttyMB &
+	      mbm /tmp/ttyMB ...
+
+   The pty slave path is printed on stdout (and linked to -L); pass it
+   to set_up_comms() like any serial device. Every slave has its own
+   coils, discrete inputs, holding and input registers, map_size of
+   each (default 10000). Holding and input registers start out with
+   their own address as value, the bits all off. A map file sets
+   other values, one per line:
+
+	slave table address value	table is c, d, h or i
+
+   FC01 - FC06, FC15, FC16 and FC23 are served; anything else gets exception
+   01, addresses past the map exception 02 and bad counts exception 03.
+   Writes to slave 0 go to every slave and get no reply.
+
+   Timing follows a real line at the given baud rate: a reply starts
+   the wire time of the query plus t3.5 plus the latency of the slave
+   after the query came in (the pty hands the query over at once), and
+   its bytes go out one character time apart.
+
+   Faults, each chosen at random per reply: -c corrupts the CRC, -x
+   drops one byte, -e answers exception 04 instead. -q makes a slave
+   never answer. The counts are printed on SIGINT or SIGTERM.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#define _GNU_SOURCE		/* posix_openpt() and friends */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "modbus_rtu.h"
+#include "modbus_crc.h"
+
+#define MAX_SLAVES 247
+#define DEFAULT_MAP_SIZE 10000
+#define MAX_FRAME 256
+
+#define EXC_ILLEGAL_FUNCTION 0x01
+#define EXC_ILLEGAL_ADDRESS 0x02
+#define EXC_ILLEGAL_VALUE 0x03
+#define EXC_DEVICE_FAILURE 0x04
+
+struct sim_slave {
+	int present;
+	int silent;
+	long latency;		/* uS */
+	unsigned char *coils;	/* one byte per bit */
+	unsigned char *inputs;
+	unsigned short *holding;
+	unsigned short *input_regs;
+};
+
+struct sim_stats {
+	long frames;		/* good CRC, any slave */
+	long replies;
+	long broadcasts;
+	long exceptions;	/* asked for, not injected */
+	long bad_crc;		/* received */
+	long not_ours;
+	long crc_injected;
+	long drop_injected;
+	long exc_injected;
+	long silenced;
+};
+
+static struct sim_slave slaves[MAX_SLAVES + 1];
+static int map_size = DEFAULT_MAP_SIZE;
+static struct modbus_timing timing;
+static struct sim_stats stats;
+
+static int crc_percent, drop_percent, exc_percent;
+
+static volatile sig_atomic_t stop;
+
+
+
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static int chance(int percent)
+{
+	return (percent > 0 && rand() % 100 < percent);
+}
+
+static void ts_add_ns(struct timespec *ts, long ns)
+{
+	ts->tv_sec += ns / 1000000000L;
+	ts->tv_nsec += ns % 1000000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+}
+
+static long ts_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+	return ((a->tv_sec - b->tv_sec) * 1000000000L
+		+ (a->tv_nsec - b->tv_nsec));
+}
+
+
+
+
+/*************************************************************************
+
+	request_length
+
+	bytes in the request starting at frame, from its function code.
+	Returns 0 if more bytes are needed to tell, -1 for a function
+	we do not know (the frame then ends at a t3.5 silence).
+
+**************************************************************************/
+
+static int request_length(const unsigned char *frame, int len)
+{
+	if (len < 2)
+		return (0);
+
+	switch (frame[1]) {
+	case 0x01:
+	case 0x02:
+	case 0x03:
+	case 0x04:
+	case 0x05:
+	case 0x06:
+		return (8);
+	case 0x0F:
+	case 0x10:
+		if (len < 7)
+			return (0);
+		return (9 + frame[6]);
+	case 0x17:
+		if (len < 11)
+			return (0);
+		return (13 + frame[10]);
+	default:
+		return (-1);
+	}
+}
+
+
+
+
+/* appends the CRC and returns the frame length */
+static int finish_reply(unsigned char *reply, int len)
+{
+	unsigned short crc = crc16(reply, len);
+
+	reply[len++] = crc & 0xFF;
+	reply[len++] = crc >> 8;
+	return (len);
+}
+
+static int exception_reply(unsigned char *reply, const unsigned char *req,
+			   int code)
+{
+	reply[0] = req[0];
+	reply[1] = req[1] | 0x80;
+	reply[2] = code;
+	return (finish_reply(reply, 3));
+}
+
+
+
+
+/*************************************************************************
+
+	serve
+
+	carries out the request on one slave. Returns the length of the
+	reply built in reply, or -code for an exception.
+
+**************************************************************************/
+
+static int serve(struct sim_slave *s, const unsigned char *req,
+		 unsigned char *reply)
+{
+	int function = req[1];
+	int addr = (req[2] << 8) | req[3];
+	int count = (req[4] << 8) | req[5];
+	unsigned char *bits;
+	unsigned short *regs;
+	int waddr, wcount;
+	int i, len;
+
+	switch (function) {
+	case 0x01:
+	case 0x02:
+		if (count < 1 || count > MAX_PDU_READ_BITS)
+			return (-EXC_ILLEGAL_VALUE);
+		if (addr + count > map_size)
+			return (-EXC_ILLEGAL_ADDRESS);
+		bits = (function == 0x01) ? s->coils : s->inputs;
+		len = 3 + (count + 7) / 8;
+		memset(reply + 3, 0, len - 3);
+		for (i = 0; i < count; i++) {
+			if (bits[addr + i])
+				reply[3 + i / 8] |= 1 << (i % 8);
+		}
+		reply[2] = len - 3;
+		break;
+
+	case 0x03:
+	case 0x04:
+		if (count < 1 || count > MAX_PDU_READ_REGS)
+			return (-EXC_ILLEGAL_VALUE);
+		if (addr + count > map_size)
+			return (-EXC_ILLEGAL_ADDRESS);
+		regs = (function == 0x03) ? s->holding : s->input_regs;
+		for (i = 0; i < count; i++) {
+			reply[3 + 2 * i] = regs[addr + i] >> 8;
+			reply[4 + 2 * i] = regs[addr + i] & 0xFF;
+		}
+		reply[2] = 2 * count;
+		len = 3 + 2 * count;
+		break;
+
+	case 0x05:
+		if (count != 0xFF00 && count != 0)
+			return (-EXC_ILLEGAL_VALUE);
+		if (addr >= map_size)
+			return (-EXC_ILLEGAL_ADDRESS);
+		s->coils[addr] = (count == 0xFF00);
+		memcpy(reply + 2, req + 2, 4);
+		len = 6;
+		break;
+
+	case 0x06:
+		if (addr >= map_size)
+			return (-EXC_ILLEGAL_ADDRESS);
+		s->holding[addr] = count;
+		memcpy(reply + 2, req + 2, 4);
+		len = 6;
+		break;
+
+	case 0x0F:
+		if (count < 1 || count > MAX_PDU_WRITE_COILS
+		    || req[6] != (count + 7) / 8)
+			return (-EXC_ILLEGAL_VALUE);
+		if (addr + count > map_size)
+			return (-EXC_ILLEGAL_ADDRESS);
+		for (i = 0; i < count; i++)
+			s->coils[addr + i] = (req[7 + i / 8] >> (i % 8)) & 1;
+		memcpy(reply + 2, req + 2, 4);
+		len = 6;
+		break;
+
+	case 0x10:
+		if (count < 1 || count > MAX_PDU_WRITE_REGS
+		    || req[6] != 2 * count)
+			return (-EXC_ILLEGAL_VALUE);
+		if (addr + count > map_size)
+			return (-EXC_ILLEGAL_ADDRESS);
+		for (i = 0; i < count; i++)
+			s->holding[addr + i] = (req[7 + 2 * i] << 8)
+			    | req[8 + 2 * i];
+		memcpy(reply + 2, req + 2, 4);
+		len = 6;
+		break;
+
+	case 0x17:
+		waddr = (req[6] << 8) | req[7];
+		wcount = (req[8] << 8) | req[9];
+		if (count < 1 || count > MAX_PDU_READ_REGS
+		    || wcount < 1 || wcount > MAX_PDU_RW_WRITE_REGS
+		    || req[10] != 2 * wcount)
+			return (-EXC_ILLEGAL_VALUE);
+		if (addr + count > map_size || waddr + wcount > map_size)
+			return (-EXC_ILLEGAL_ADDRESS);
+		/* the write goes first */
+		for (i = 0; i < wcount; i++)
+			s->holding[waddr + i] = (req[11 + 2 * i] << 8)
+			    | req[12 + 2 * i];
+		for (i = 0; i < count; i++) {
+			reply[3 + 2 * i] = s->holding[addr + i] >> 8;
+			reply[4 + 2 * i] = s->holding[addr + i] & 0xFF;
+		}
+		reply[2] = 2 * count;
+		len = 3 + 2 * count;
+		break;
+
+	default:
+		return (-EXC_ILLEGAL_FUNCTION);
+	}
+
+	reply[0] = req[0];
+	reply[1] = function;
+	return (finish_reply(reply, len));
+}
+
+
+
+
+/*************************************************************************
+
+	send_paced
+
+	writes the reply starting at at, each byte once it would have
+	been clocked out in full, one character time after the one
+	before. At high speeds the bytes that are due go out together
+	rather than sleeping for each.
+
+**************************************************************************/
+
+static void send_paced(int fd, const unsigned char *reply, int len,
+		       struct timespec *at)
+{
+	struct timespec now, next;
+	int sent = 0, due;
+
+	while (sent < len && !stop) {
+		next = *at;
+		ts_add_ns(&next, (long) (sent + 1) * timing.char_ns);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		due = ts_diff_ns(&now, at) / timing.char_ns;
+		if (due > len)
+			due = len;
+		if (due > sent) {
+			if (write(fd, reply + sent, due - sent) < 0
+			    && errno != EAGAIN && errno != EINTR)
+				return;
+			sent = due;
+		}
+	}
+}
+
+
+
+
+/* a whole request came in at arrived */
+static void handle_frame(int fd, unsigned char *req, int len,
+			 struct timespec *arrived)
+{
+	unsigned char reply[MAX_FRAME];
+	unsigned short crc;
+	struct sim_slave *s;
+	struct timespec at;
+	int n, i, pos;
+
+	if (len < 4) {
+		stats.bad_crc++;
+		return;
+	}
+	crc = crc16(req, len - 2);
+	if (req[len - 2] != (crc & 0xFF) || req[len - 1] != crc >> 8) {
+		stats.bad_crc++;
+		return;
+	}
+
+	if (req[0] == 0) {
+		if (req[1] != 0x05 && req[1] != 0x06
+		    && req[1] != 0x0F && req[1] != 0x10)
+			return;
+		stats.broadcasts++;
+		for (i = 1; i <= MAX_SLAVES; i++) {
+			if (slaves[i].present)
+				serve(&slaves[i], req, reply);
+		}
+		return;
+	}
+
+	if (req[0] > MAX_SLAVES || !slaves[req[0]].present) {
+		stats.not_ours++;
+		return;
+	}
+	s = &slaves[req[0]];
+	stats.frames++;
+	if (s->silent) {
+		stats.silenced++;
+		return;
+	}
+
+	if (chance(exc_percent)) {
+		n = exception_reply(reply, req, EXC_DEVICE_FAILURE);
+		stats.exc_injected++;
+	} else {
+		n = serve(s, req, reply);
+		if (n < 0) {
+			n = exception_reply(reply, req, -n);
+			stats.exceptions++;
+		}
+	}
+
+	if (chance(crc_percent)) {
+		reply[n - 1] ^= 0x5A;
+		stats.crc_injected++;
+	}
+	if (n > 1 && chance(drop_percent)) {
+		pos = rand() % n;
+		memmove(reply + pos, reply + pos + 1, n - pos - 1);
+		n--;
+		stats.drop_injected++;
+	}
+
+	/* the query took len characters on the wire, then the gap */
+	at = *arrived;
+	ts_add_ns(&at, (long) len * timing.char_ns
+		  + (timing.t35 + s->latency) * 1000L);
+	send_paced(fd, reply, n, &at);
+	stats.replies++;
+}
+
+
+
+
+static int parse_range(char *arg, int *first, int *last)
+{
+	char *dash;
+
+	*first = atoi(arg);
+	dash = strchr(arg, '-');
+	*last = dash ? atoi(dash + 1) : *first;
+	return ((*first < 1 || *last > MAX_SLAVES || *first > *last) ? -1 : 0);
+}
+
+static int load_map(const char *path)
+{
+	char line[128], table;
+	int slave, addr, value, n = 0;
+	FILE *f;
+
+	if (!(f = fopen(path, "r")))
+		return (-1);
+
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%d %c %i %i", &slave, &table, &addr,
+			   &value) != 4 || slave < 1 || slave > MAX_SLAVES
+		    || !slaves[slave].present || addr < 0 || addr >= map_size) {
+			fprintf(stderr, "mbsim: %s line %d ignored\n", path, n);
+			continue;
+		}
+		switch (table) {
+		case 'c':
+			slaves[slave].coils[addr] = value != 0;
+			break;
+		case 'd':
+			slaves[slave].inputs[addr] = value != 0;
+			break;
+		case 'h':
+			slaves[slave].holding[addr] = value;
+			break;
+		case 'i':
+			slaves[slave].input_regs[addr] = value;
+			break;
+		default:
+			fprintf(stderr, "mbsim: %s line %d ignored\n", path, n);
+		}
+	}
+
+	fclose(f);
+	return (0);
+}
+
+static int add_slave(struct sim_slave *s, long latency)
+{
+	int i;
+
+	s->present = 1;
+	s->latency = latency;
+	s->coils = calloc(map_size, 1);
+	s->inputs = calloc(map_size, 1);
+	s->holding = calloc(map_size, sizeof(unsigned short));
+	s->input_regs = calloc(map_size, sizeof(unsigned short));
+	if (!s->coils || !s->inputs || !s->holding || !s->input_regs)
+		return (-1);
+
+	for (i = 0; i < map_size; i++)
+		s->holding[i] = s->input_regs[i] = i;
+	return (0);
+}
+
+static void print_stats(void)
+{
+	fprintf(stderr, "mbsim: %ld frames, %ld replies, %ld broadcasts, "
+		"%ld exceptions\n", stats.frames, stats.replies,
+		stats.broadcasts, stats.exceptions);
+	fprintf(stderr, "mbsim: %ld bad CRC in, %ld for other slaves, "
+		"%ld not answered\n", stats.bad_crc, stats.not_ours,
+		stats.silenced);
+	fprintf(stderr, "mbsim: injected %ld CRC errors, %ld dropped bytes, "
+		"%ld exceptions\n", stats.crc_injected, stats.drop_injected,
+		stats.exc_injected);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: mbsim [-b baud] [-p none|even|odd] "
+		"[-s first[-last]] [-n map_size]\n"
+		"             [-f map_file] [-d latency_us] "
+		"[-D slave=latency_us] [-c crc_%%]\n"
+		"             [-x drop_%%] [-e exception_%%] [-q slave] "
+		"[-S seed] [-L link]\n");
+	exit(1);
+}
+
+
+
+
+int main(int argc, char *argv[])
+{
+	struct termios settings;
+	struct sigaction sa;
+	struct timespec now, last_byte;
+	struct pollfd pfd;
+	unsigned char frame[MAX_FRAME];
+	char *map_file = NULL, *link_path = NULL, *parity = "none";
+	char *pts, *eq;
+	long latency = 0, slave_latency[MAX_SLAVES + 1];
+	int silent[MAX_SLAVES + 1];
+	int baud = 19200, first = 1, last = MAX_SLAVES;
+	int master, keep, opt, i, n, len = 0, want, gap_us;
+	unsigned int seed = 1;
+
+	for (i = 0; i <= MAX_SLAVES; i++) {
+		slave_latency[i] = -1;
+		silent[i] = 0;
+	}
+
+	while ((opt = getopt(argc, argv, "b:p:s:n:f:d:D:c:x:e:q:S:L:")) != -1) {
+		switch (opt) {
+		case 'b':
+			baud = atoi(optarg);
+			break;
+		case 'p':
+			parity = optarg;
+			break;
+		case 's':
+			if (parse_range(optarg, &first, &last) < 0)
+				usage();
+			break;
+		case 'n':
+			map_size = atoi(optarg);
+			if (map_size < 1 || map_size > 65536)
+				usage();
+			break;
+		case 'f':
+			map_file = optarg;
+			break;
+		case 'd':
+			latency = atol(optarg);
+			break;
+		case 'D':
+			eq = strchr(optarg, '=');
+			i = atoi(optarg);
+			if (!eq || i < 1 || i > MAX_SLAVES)
+				usage();
+			slave_latency[i] = atol(eq + 1);
+			break;
+		case 'c':
+			crc_percent = atoi(optarg);
+			break;
+		case 'x':
+			drop_percent = atoi(optarg);
+			break;
+		case 'e':
+			exc_percent = atoi(optarg);
+			break;
+		case 'q':
+			i = atoi(optarg);
+			if (i < 1 || i > MAX_SLAVES)
+				usage();
+			silent[i] = 1;
+			break;
+		case 'S':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			link_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+	srand(seed);
+
+	for (i = first; i <= last; i++) {
+		if (add_slave(&slaves[i], slave_latency[i] >= 0
+			      ? slave_latency[i] : latency) < 0) {
+			fprintf(stderr, "mbsim: out of memory\n");
+			return 1;
+		}
+		slaves[i].silent = silent[i];
+	}
+	if (map_file && load_map(map_file) < 0) {
+		fprintf(stderr, "mbsim: cannot read %s\n", map_file);
+		return 1;
+	}
+
+	/* start + 8 data bits + parity + stop bit */
+	compute_char_timing(baud, strncmp(parity, "none", 4) ? 11 : 10,
+			    &timing);
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0
+	    || !(pts = ptsname(master))) {
+		fprintf(stderr, "mbsim: no pseudo terminal\n");
+		return 1;
+	}
+
+	/* keep the slave side open so the master end does not see a */
+	/* hangup between two runs of a client; raw until the client   */
+	/* sets it up                                                   */
+	keep = open(pts, O_RDWR | O_NOCTTY);
+	if (keep < 0 || tcgetattr(keep, &settings) < 0) {
+		fprintf(stderr, "mbsim: cannot open %s\n", pts);
+		return 1;
+	}
+	cfmakeraw(&settings);
+	tcsetattr(keep, TCSANOW, &settings);
+
+	if (link_path) {
+		unlink(link_path);
+		if (symlink(pts, link_path) < 0) {
+			fprintf(stderr, "mbsim: cannot link %s\n", link_path);
+			return 1;
+		}
+	}
+	printf("%s\n", pts);
+	fflush(stdout);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* the gap that ends a frame whose length we cannot tell */
+	gap_us = timing.t35;
+
+	pfd.fd = master;
+	pfd.events = POLLIN;
+
+	while (!stop) {
+		n = poll(&pfd, 1, len ? (gap_us + 999) / 1000 : -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (n == 0 || (len && ts_diff_ns(&now, &last_byte)
+			       > gap_us * 1000L)) {
+			/* silence: whatever we have is a frame */
+			if (len)
+				handle_frame(master, frame, len, &last_byte);
+			len = 0;
+			if (n == 0)
+				continue;
+		}
+
+		n = read(master, frame + len, MAX_FRAME - len);
+		if (n <= 0)
+			continue;
+		len += n;
+		last_byte = now;
+
+		/* pull out as many whole requests as came in */
+		while (len > 0 && (want = request_length(frame, len)) > 0
+		       && want <= len) {
+			handle_frame(master, frame, want, &now);
+			memmove(frame, frame + want, len - want);
+			len -= want;
+		}
+		if (want > MAX_FRAME || len == MAX_FRAME)
+			len = 0;
+	}
+
+	print_stats();
+	if (link_path)
+		unlink(link_path);
+	return 0;
+}
@@ -0,0 +1,343 @@
+/* modbus_async.cpp
+
+   Coroutine front end for the RTU master, on top of modbus_loop.c.
+
+   A ModbusOp takes a transaction from the pool of its master when it
+   is awaited, builds the query into it and submits it to the bus. The
+   loop calls txn_done() when the reply is in; the reply is decoded
+   into the caller's array, the transaction goes back to the pool (or
+   straight to the next op waiting for one) and the coroutine resumes.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include "modbus_async.h"
+
+#define REQUEST_QUERY_SIZE 6	/* FC01 to FC06, without the checksum */
+
+
+
+
+/************************************************************************
+
+	ModbusMaster
+
+	the whole pool is allocated here, once.
+
+*************************************************************************/
+
+ModbusMaster::ModbusMaster(struct rtu_bus *bus, int pool_size, long timeout)
+    : bus(bus), timeout(timeout), free_list(nullptr),
+      wait_head(nullptr), wait_tail(nullptr)
+{
+	int i;
+
+	if (pool_size < 1)
+		pool_size = 1;
+
+	pool = new struct rtu_txn[pool_size];
+	for (i = 0; i < pool_size; i++) {
+		pool[i].next = free_list;
+		free_list = &pool[i];
+	}
+}
+
+ModbusMaster::~ModbusMaster()
+{
+	delete[] pool;
+}
+
+struct rtu_txn *ModbusMaster::acquire()
+{
+	struct rtu_txn *txn = free_list;
+
+	if (txn)
+		free_list = txn->next;
+	return (txn);
+}
+
+/* hand the transaction to the first op waiting, else back to the pool */
+void ModbusMaster::release(struct rtu_txn *txn)
+{
+	ModbusOp *op = wait_head;
+
+	if (op) {
+		wait_head = op->next;
+		if (!wait_head)
+			wait_tail = nullptr;
+		op->next = nullptr;
+		op->start(txn);
+		return;
+	}
+
+	txn->next = free_list;
+	free_list = txn;
+}
+
+
+
+
+/************************************************************************
+
+	the calls
+
+	same clamping as the blocking calls.
+
+*************************************************************************/
+
+ModbusOp ModbusMaster::read_coils(int slave, int start_addr, int count,
+				  int *dest, int dest_size)
+{
+	return ModbusOp(this, ModbusOp::READ_BITS, slave, 0x01, start_addr,
+			count, dest, dest_size);
+}
+
+ModbusOp ModbusMaster::read_inputs(int slave, int start_addr, int count,
+				   int *dest, int dest_size)
+{
+	return ModbusOp(this, ModbusOp::READ_BITS, slave, 0x02, start_addr,
+			count, dest, dest_size);
+}
+
+ModbusOp ModbusMaster::read_holding(int slave, int start_addr, int count,
+				    int *dest, int dest_size)
+{
+	if (count > MAX_READ_REGS)
+		count = MAX_READ_REGS;
+
+	return ModbusOp(this, ModbusOp::READ_REGS, slave, 0x03, start_addr,
+			count, dest, dest_size);
+}
+
+ModbusOp ModbusMaster::read_input_regs(int slave, int start_addr, int count,
+				       int *dest, int dest_size)
+{
+	if (count > MAX_INPUT_REGS)
+		count = MAX_INPUT_REGS;
+
+	return ModbusOp(this, ModbusOp::READ_REGS, slave, 0x04, start_addr,
+			count, dest, dest_size);
+}
+
+ModbusOp ModbusMaster::read_holding(int slave, int start_addr,
+				    std::span<uint16_t> dest)
+{
+	int count = dest.size();
+
+	if (count > MAX_READ_REGS)
+		count = MAX_READ_REGS;
+
+	ModbusOp op(this, ModbusOp::READ_REGS16, slave, 0x03, start_addr,
+		    count, nullptr, dest.size());
+	op.regs16 = dest.data();
+	return op;
+}
+
+ModbusOp ModbusMaster::read_input_regs(int slave, int start_addr,
+				       std::span<uint16_t> dest)
+{
+	int count = dest.size();
+
+	if (count > MAX_INPUT_REGS)
+		count = MAX_INPUT_REGS;
+
+	ModbusOp op(this, ModbusOp::READ_REGS16, slave, 0x04, start_addr,
+		    count, nullptr, dest.size());
+	op.regs16 = dest.data();
+	return op;
+}
+
+ModbusOp ModbusMaster::force_coil(int slave, int addr, int state)
+{
+	if (state)
+		state = 0xFF00;
+
+	return ModbusOp(this, ModbusOp::WRITE_SINGLE, slave, 0x05, addr,
+			state, nullptr, 0);
+}
+
+ModbusOp ModbusMaster::preset_register(int slave, int addr, int value)
+{
+	return ModbusOp(this, ModbusOp::WRITE_SINGLE, slave, 0x06, addr,
+			value, nullptr, 0);
+}
+
+ModbusOp ModbusMaster::set_coils(int slave, int start_addr, int count,
+				 int *data)
+{
+	if (count > MAX_WRITE_COILS)
+		count = MAX_WRITE_COILS;
+
+	return ModbusOp(this, ModbusOp::WRITE_COILS, slave, 0x0F, start_addr,
+			count, data, 0);
+}
+
+ModbusOp ModbusMaster::preset_registers(int slave, int start_addr,
+					int count, int *data)
+{
+	if (count > MAX_WRITE_REGS)
+		count = MAX_WRITE_REGS;
+
+	return ModbusOp(this, ModbusOp::WRITE_REGS, slave, 0x10, start_addr,
+			count, data, 0);
+}
+
+ModbusOp ModbusMaster::preset_registers(int slave, int start_addr,
+					std::span<const uint16_t> data)
+{
+	int count = data.size();
+
+	if (count > MAX_WRITE_REGS)
+		count = MAX_WRITE_REGS;
+
+	/* only read from, like the data of the int version */
+	ModbusOp op(this, ModbusOp::WRITE_REGS16, slave, 0x10, start_addr,
+		    count, nullptr, 0);
+	op.regs16 = const_cast<uint16_t *>(data.data());
+	return op;
+}
+
+
+
+
+/************************************************************************
+
+	ModbusOp::await_suspend
+
+	starts the transaction, or queues the op until one is free. A
+	transaction that fails while it is being submitted completes
+	before we return; then the coroutine just carries on.
+
+*************************************************************************/
+
+bool ModbusOp::await_suspend(std::coroutine_handle<> h)
+{
+	struct rtu_txn *t;
+
+	waiter = h;
+
+	t = master->acquire();
+	if (!t) {
+		if (master->wait_tail)
+			master->wait_tail->next = this;
+		else
+			master->wait_head = this;
+		master->wait_tail = this;
+		return true;
+	}
+
+	submitting = true;
+	start(t);
+	submitting = false;
+
+	return !done;
+}
+
+
+
+
+/************************************************************************
+
+	ModbusOp::start
+
+	builds the query into the transaction and submits it.
+
+*************************************************************************/
+
+void ModbusOp::start(struct rtu_txn *t)
+{
+	txn = t;
+	txn->done = txn_done;
+	txn->arg = this;
+	txn->timeout = master->timeout;
+
+	switch (kind) {
+	case WRITE_COILS:
+		txn->query_length = build_coils_packet(slave, start_addr,
+						       count, data,
+						       txn->query);
+		break;
+	case WRITE_REGS:
+		txn->query_length = build_registers_packet(slave, start_addr,
+							   count, data,
+							   txn->query);
+		break;
+	case WRITE_REGS16:
+		txn->query_length = build_registers_packet16(slave, start_addr,
+							     count, regs16,
+							     txn->query);
+		break;
+	default:
+		/* reads, and FC05/FC06 with the value as the count */
+		build_request_packet(slave, function, start_addr, count,
+				     txn->query);
+		txn->query_length = REQUEST_QUERY_SIZE;
+		break;
+	}
+
+	rtu_bus_submit(master->bus, txn);
+}
+
+
+
+
+/************************************************************************
+
+	ModbusOp::txn_done
+
+	called by the loop. Decodes the reply like read_IO_stat_response()
+	and read_reg_response() do, then gives the transaction back
+	before resuming, so the coroutine can issue its next call at once.
+
+*************************************************************************/
+
+void ModbusOp::txn_done(struct rtu_txn *t, int status)
+{
+	ModbusOp *op = static_cast<ModbusOp *>(t->arg);
+
+	if (status > 0) {
+		switch (op->kind) {
+		case READ_BITS:
+			decode_bits(t->response, status, op->count,
+				    op->data, op->dest_size);
+			break;
+		case READ_REGS:
+			decode_registers(t->response, status,
+					 op->data, op->dest_size);
+			status -= 2;
+			break;
+		case READ_REGS16:
+			decode_registers16(t->response, status,
+					   op->regs16, op->dest_size);
+			status -= 2;
+			break;
+		default:
+			break;
+		}
+	}
+
+	op->txn = nullptr;
+	op->master->release(t);
+	op->complete(status);
+}
+
+void ModbusOp::complete(int result)
+{
+	status = result;
+	done = true;
+	if (!submitting)
+		waiter.resume();
+}
@@ -0,0 +1,205 @@
+/* 		modbus_async.h
+
+   C++20 coroutine front end for the RTU master.
+
+   ModbusMaster runs the usual master calls as transactions on a bus of
+   an rtu_loop (see modbus_loop.h). Each call returns an object to
+   co_await; the coroutine is suspended until the reply is in or has
+   timed out and gets the same return value the blocking call would
+   give. The queries are built by the functions the blocking calls
+   use, so both put the same bytes on the wire.
+
+	ModbusTask poll(ModbusMaster &m)
+	{
+		int regs[10];
+
+		if (co_await m.read_holding(1, 1, 10, regs, 10) > 0)
+			...
+	}
+
+   The transactions come from a pool allocated once by the
+   constructor; nothing is allocated per call. When the pool is empty
+   a call waits, in order, for the first transaction to come back.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_ASYNC_H
+#define MODBUS_ASYNC_H
+
+#include <coroutine>
+#include <exception>
+#include <span>
+#include <stdint.h>
+#include "modbus_rtu.h"
+#include "modbus_loop.h"
+
+
+class ModbusMaster;
+
+
+/************************************************************************
+
+	ModbusTask
+
+	a coroutine that starts right away and runs on its own until
+	it returns. Good enough for poll loops driven by
+	rtu_loop_dispatch(); use your own task type if you need to
+	wait for the result of a coroutine.
+
+*************************************************************************/
+
+struct ModbusTask {
+	struct promise_type {
+		ModbusTask get_return_object() { return ModbusTask(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+
+
+/************************************************************************
+
+	ModbusOp
+
+	what the calls of ModbusMaster return. co_await it once; the
+	result is the return value of the matching blocking call. The
+	arrays passed to the call must stay valid until then.
+
+*************************************************************************/
+
+class ModbusOp {
+public:
+	bool await_ready() { return false; }
+	bool await_suspend(std::coroutine_handle<> h);
+	int await_resume() { return status; }
+
+private:
+	friend class ModbusMaster;
+
+	enum Kind {
+		READ_BITS,
+		READ_REGS,
+		READ_REGS16,
+		WRITE_SINGLE,
+		WRITE_COILS,
+		WRITE_REGS,
+		WRITE_REGS16
+	};
+
+	ModbusOp(ModbusMaster *master, Kind kind, int slave, int function,
+		 int start_addr, int count, int *data, int dest_size)
+	    : master(master), kind(kind), slave(slave), function(function),
+	      start_addr(start_addr), count(count), data(data),
+	      dest_size(dest_size), regs16(nullptr) {}
+
+	void start(struct rtu_txn *txn);
+	void complete(int status);
+	static void txn_done(struct rtu_txn *txn, int status);
+
+	ModbusMaster *master;
+	Kind kind;
+	int slave;
+	int function;
+	int start_addr;
+	int count;
+	int *data;		/* dest of a read, source of a write */
+	int dest_size;
+	uint16_t *regs16;	/* the same for the uint16_t calls */
+
+	std::coroutine_handle<> waiter;
+	struct rtu_txn *txn = nullptr;
+	int status = COMMS_FAILURE;
+	bool submitting = false;	/* inside await_suspend() */
+	bool done = false;
+	ModbusOp *next = nullptr;	/* waiting for a transaction */
+};
+
+
+
+/************************************************************************
+
+	ModbusMaster
+
+	one bus, already added to a loop with rtu_bus_add(). pool_size
+	transactions can be queued on it at a time. timeout is the uS
+	to wait for a reply, 0 for the loop default of 1 sec.
+
+	The master must outlive every call made on it.
+
+*************************************************************************/
+
+class ModbusMaster {
+public:
+	ModbusMaster(struct rtu_bus *bus, int pool_size = 16,
+		     long timeout = 0);
+	~ModbusMaster();
+
+	ModbusMaster(const ModbusMaster &) = delete;
+	ModbusMaster &operator=(const ModbusMaster &) = delete;
+
+	void set_timeout(long usec) { timeout = usec; }
+
+	/* read_coil_status() and read_input_status() */
+	ModbusOp read_coils(int slave, int start_addr, int count,
+			    int *dest, int dest_size);
+	ModbusOp read_inputs(int slave, int start_addr, int count,
+			     int *dest, int dest_size);
+
+	/* read_holding_registers() and read_input_registers() */
+	ModbusOp read_holding(int slave, int start_addr, int count,
+			      int *dest, int dest_size);
+	ModbusOp read_input_regs(int slave, int start_addr, int count,
+				 int *dest, int dest_size);
+
+	/* read_holding_registers16() and read_input_registers16(); */
+	/* count is the size of dest                                 */
+	ModbusOp read_holding(int slave, int start_addr,
+			      std::span<uint16_t> dest);
+	ModbusOp read_input_regs(int slave, int start_addr,
+				 std::span<uint16_t> dest);
+
+	/* force_single_coil() and preset_single_register() */
+	ModbusOp force_coil(int slave, int addr, int state);
+	ModbusOp preset_register(int slave, int addr, int value);
+
+	/* set_multiple_coils() and preset_multiple_registers() */
+	ModbusOp set_coils(int slave, int start_addr, int count, int *data);
+	ModbusOp preset_registers(int slave, int start_addr, int count,
+				  int *data);
+
+	/* preset_multiple_registers16() */
+	ModbusOp preset_registers(int slave, int start_addr,
+				  std::span<const uint16_t> data);
+
+private:
+	friend class ModbusOp;
+
+	struct rtu_txn *acquire();
+	void release(struct rtu_txn *txn);
+
+	struct rtu_bus *bus;
+	long timeout;
+	struct rtu_txn *pool;
+	struct rtu_txn *free_list;	/* chained through next */
+	ModbusOp *wait_head, *wait_tail;
+};
+
+
+#endif  /* MODBUS_ASYNC_H */
@@ -0,0 +1,320 @@
+/* modbus_batch.c
+
+   Write-behind batching for the RTU master.
+
+   A flush sorts the queue by slave, table and address, keeping the
+   order of writes to the same address so the last one queued wins.
+   Addresses whose final value is the one the slave acknowledged last
+   are taken out first. What is left is cut into runs of neighbouring
+   addresses of the same slave and table, each at most one frame long;
+   a run of one goes out as FC06/FC05, longer ones as FC16/FC15.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include "modbus_rtu.h"
+#include "modbus_batch.h"
+
+
+/* sort order: slave, table, address; equal keys keep their order */
+static int write_before(struct batch_write *a, struct batch_write *b)
+{
+	if (a->slave != b->slave)
+		return (a->slave < b->slave);
+	if (a->table != b->table)
+		return (a->table < b->table);
+	return (a->addr < b->addr);
+}
+
+static int same_address(struct batch_write *a, struct batch_write *b)
+{
+	return (a->slave == b->slave && a->table == b->table
+		&& a->addr == b->addr);
+}
+
+
+
+
+/************************************************************************
+
+	find_acked
+
+	the slot of an address in the acknowledged values; a free one
+	if it is not there yet, NULL if it is not there and the array
+	is full.
+
+*************************************************************************/
+
+static struct acked_value *find_acked(struct write_batch *batch, int slave,
+				      int table, int addr)
+{
+	struct acked_value *a;
+	unsigned int h;
+	int i;
+
+	if (batch->n_acked < 1)
+		return (NULL);
+
+	h = ((unsigned) addr * 0x9E3779B1u) ^ ((unsigned) slave << 8) ^ table;
+	for (i = 0; i < batch->n_acked; i++) {
+		a = &batch->acked[(h + i) % batch->n_acked];
+		if (a->slave == 0)
+			return (a);
+		if (a->slave == slave && a->table == table && a->addr == addr)
+			return (a);
+	}
+	return (NULL);
+}
+
+
+
+
+/************************************************************************
+
+	batch_init / batch_forget
+
+*************************************************************************/
+
+void batch_init(struct write_batch *batch, int fd, long window,
+		struct acked_value *acked, int n_acked)
+{
+	batch->fd = fd;
+	batch->window = window;
+	batch->head = NULL;
+	batch->tail = NULL;
+	batch->acked = acked;
+	batch->n_acked = n_acked;
+	batch->writes = 0;
+	batch->skipped = 0;
+	batch->frames = 0;
+
+	batch_forget(batch);
+}
+
+void batch_forget(struct write_batch *batch)
+{
+	int i;
+
+	for (i = 0; i < batch->n_acked; i++)
+		batch->acked[i].slave = 0;
+}
+
+
+
+
+/************************************************************************
+
+	batch_preset_register / batch_force_coil
+
+*************************************************************************/
+
+static void queue_write(struct write_batch *batch, struct batch_write *w,
+			int slave, int table, int addr, int value)
+{
+	w->slave = slave;
+	w->table = table;
+	w->addr = addr;
+	w->value = value;
+	w->pending = 1;
+	w->status = COMMS_FAILURE;
+	w->next = NULL;
+
+	if (batch->tail) {
+		batch->tail->next = w;
+	} else {
+		batch->head = w;
+		clock_gettime(CLOCK_MONOTONIC, &batch->first);
+	}
+	batch->tail = w;
+	batch->writes++;
+}
+
+void batch_preset_register(struct write_batch *batch, struct batch_write *w,
+			   int slave, int addr, int value)
+{
+	queue_write(batch, w, slave, 0x03, addr, value & 0xFFFF);
+}
+
+void batch_force_coil(struct write_batch *batch, struct batch_write *w,
+		      int slave, int addr, int state)
+{
+	queue_write(batch, w, slave, 0x01, addr, state ? 1 : 0);
+}
+
+
+
+
+/************************************************************************
+
+	drop_acked
+
+	takes the addresses whose last queued value is already on the
+	slave out of the sorted list and completes their writes.
+
+*************************************************************************/
+
+static struct batch_write *drop_acked(struct write_batch *batch,
+				      struct batch_write *sorted)
+{
+	struct batch_write *keep = NULL, **tail = &keep;
+	struct batch_write *w, *last, *next;
+	struct acked_value *a;
+
+	for (w = sorted; w; w = next) {
+		/* w up to last write the same address */
+		for (last = w; last->next && same_address(last->next, w);
+		     last = last->next);
+		next = last->next;
+
+		a = find_acked(batch, w->slave, w->table, w->addr);
+		if (a && a->slave && a->value == last->value) {
+			for (; w != next; w = w->next) {
+				w->pending = 0;
+				w->status = a->status;
+				batch->skipped++;
+			}
+			continue;
+		}
+
+		*tail = w;
+		tail = &last->next;
+	}
+	*tail = NULL;
+
+	return (keep);
+}
+
+
+
+
+/************************************************************************
+
+	send_run
+
+	writes values[0 .. n - 1] from addr on in one frame.
+
+*************************************************************************/
+
+static int send_run(struct write_batch *batch, int slave, int table,
+		    int addr, int n, int *values)
+{
+	int status;
+
+	batch->frames++;
+
+	if (n == 1 && table == 0x01)
+		return (force_single_coil(slave, addr, values[0], batch->fd));
+	if (n == 1)
+		return (preset_single_register(slave, addr, values[0],
+					       batch->fd));
+
+	if (table == 0x01)
+		set_multiple_coils_bulk(slave, addr, n, values, &status, 1,
+					batch->fd);
+	else
+		preset_multiple_registers_bulk(slave, addr, n, values,
+					       &status, 1, batch->fd);
+	return (status);
+}
+
+
+
+
+/************************************************************************
+
+	batch_flush / batch_poll
+
+*************************************************************************/
+
+int batch_flush(struct write_batch *batch)
+{
+	int values[MAX_PDU_WRITE_COILS];
+	struct batch_write *sorted = NULL, **link, *w, *p, *next;
+	struct acked_value *a;
+	int n, limit, addr, status, failed = 0;
+
+	for (w = batch->head; w; w = next) {
+		next = w->next;
+		link = &sorted;
+		while (*link && !write_before(w, *link))
+			link = &(*link)->next;
+		w->next = *link;
+		*link = w;
+	}
+	batch->head = NULL;
+	batch->tail = NULL;
+
+	sorted = drop_acked(batch, sorted);
+
+	for (w = sorted; w; w = p) {
+		limit = w->table == 0x01 ? MAX_PDU_WRITE_COILS
+		    : MAX_PDU_WRITE_REGS;
+
+		/* the run: same slave and table, no hole in the */
+		/* addresses; repeats of an address overwrite    */
+		n = 0;
+		for (p = w; p && p->slave == w->slave && p->table == w->table;
+		     p = p->next) {
+			if (p->addr == w->addr + n) {
+				if (n == limit)
+					break;
+				n++;
+			} else if (p->addr != w->addr + n - 1) {
+				break;
+			}
+			values[n - 1] = p->value;
+		}
+
+		addr = w->addr;
+		status = send_run(batch, w->slave, w->table, addr, n, values);
+		if (status <= 0)
+			failed++;
+
+		for (; w != p; w = w->next) {
+			w->pending = 0;
+			w->status = status;
+			if (status <= 0)
+				continue;
+			a = find_acked(batch, w->slave, w->table, w->addr);
+			if (a) {
+				a->slave = w->slave;
+				a->table = w->table;
+				a->addr = w->addr;
+				a->value = values[w->addr - addr];
+				a->status = status;
+			}
+		}
+	}
+
+	return (failed);
+}
+
+int batch_poll(struct write_batch *batch)
+{
+	struct timespec now;
+	long waited;
+
+	if (!batch->head)
+		return (0);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	waited = (now.tv_sec - batch->first.tv_sec) * 1000000L
+	    + (now.tv_nsec - batch->first.tv_nsec) / 1000;
+	if (waited < batch->window)
+		return (0);
+
+	return (batch_flush(batch));
+}
@@ -0,0 +1,173 @@
+/* 		modbus_batch.h
+
+   Write-behind batching for the RTU master.
+
+   Single register and coil writes are queued instead of sent. When the
+   queue is flushed, by the caller or once the oldest write has waited
+   for the batch window, the writes of each slave are sorted and every
+   run of neighbouring addresses goes out as one FC16 or FC15 frame.
+   Writes of the value the slave already acknowledged are not sent at
+   all. Every write still gets the status of the frame that carried it.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_BATCH_H
+#define MODBUS_BATCH_H
+
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/************************************************************************
+
+	struct batch_write
+
+	one queued write, owned by the caller. It must stay put while
+	pending is set. status is then the return value of the frame
+	that carried it, like preset_single_register() would return;
+	a write that was skipped gets the status of the frame that
+	wrote the value before.
+
+*************************************************************************/
+
+struct batch_write {
+	int slave;
+	int table;		/* 0x01 coils, 0x03 holding registers */
+	int addr;
+	int value;
+
+	int pending;
+	int status;
+	struct batch_write *next;	/* kept by the batch */
+};
+
+
+
+/************************************************************************
+
+	struct acked_value
+
+	the last value a slave acknowledged for an address. The caller
+	provides an array of them, one per address written is enough.
+
+*************************************************************************/
+
+struct acked_value {
+	int slave;		/* 0 if the slot is free */
+	int table;
+	int addr;
+	int value;
+	int status;
+};
+
+
+
+/************************************************************************
+
+	struct write_batch
+
+	window is the uS the first queued write may wait. writes
+	counts the writes queued, skipped those that were not sent,
+	frames the requests that went to the bus.
+
+*************************************************************************/
+
+struct write_batch {
+	int fd;
+	long window;
+	struct batch_write *head, *tail;
+	struct timespec first;	/* when the oldest pending write came */
+	struct acked_value *acked;
+	int n_acked;
+
+	unsigned long writes;
+	unsigned long skipped;
+	unsigned long frames;
+};
+
+
+
+/************************************************************************
+
+	batch_init()
+
+*************************************************************************/
+
+void batch_init( struct write_batch *batch, int fd, long window,
+		 struct acked_value *acked, int n_acked );
+
+
+
+/************************************************************************
+
+	batch_preset_register()	batch_force_coil()
+
+	queue a write, like preset_single_register() and
+	force_single_coil(). A later write to the same address before
+	the flush wins; both get the same status.
+
+*************************************************************************/
+
+void batch_preset_register( struct write_batch *batch,
+			    struct batch_write *w,
+			    int slave, int addr, int value );
+
+void batch_force_coil( struct write_batch *batch, struct batch_write *w,
+		       int slave, int addr, int state );
+
+
+
+/************************************************************************
+
+	batch_poll()	batch_flush()
+
+	batch_flush() sends every pending write. batch_poll() does the
+	same if the oldest one has waited for the window, and nothing
+	otherwise; call it from the control loop.
+
+	Returns:	the number of frames that failed
+
+*************************************************************************/
+
+int batch_poll( struct write_batch *batch );
+
+int batch_flush( struct write_batch *batch );
+
+
+
+/************************************************************************
+
+	batch_forget()
+
+	forgets the acknowledged values, e.g. after a slave restarted
+	or was written to by other means, so the next writes are sent
+	whatever their value.
+
+*************************************************************************/
+
+void batch_forget( struct write_batch *batch );
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MODBUS_BATCH_H */
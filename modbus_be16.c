@@ -0,0 +1,164 @@
+/* modbus_be16.c
+
+   Big endian register conversion for Modbus frames.
+
+   Decoding and encoding are the same operation on bytes: swap the
+   two bytes of every register (on a big endian host, copy them). The
+   vector versions do a whole register block per shuffle and finish
+   the tail with the plain loop.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include <string.h>
+#include "modbus_be16.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BE16_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BE16_NEON
+#endif
+
+
+/* n registers, byte by byte */
+static void swap_plain(unsigned char *dst, const unsigned char *src,
+		       size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		dst[2 * i] = src[2 * i + 1];
+		dst[2 * i + 1] = src[2 * i];
+	}
+}
+
+
+#ifdef BE16_X86
+
+__attribute__((target("ssse3")))
+static void swap_ssse3(unsigned char *dst, const unsigned char *src,
+		       size_t n)
+{
+	const __m128i pairs = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+					    9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (src + 2 * i));
+		_mm_storeu_si128((__m128i *) (dst + 2 * i),
+				 _mm_shuffle_epi8(v, pairs));
+	}
+	swap_plain(dst + 2 * i, src + 2 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void swap_avx2(unsigned char *dst, const unsigned char *src,
+		      size_t n)
+{
+	const __m256i pairs = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+					       9, 8, 11, 10, 13, 12, 15, 14,
+					       1, 0, 3, 2, 5, 4, 7, 6,
+					       9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)
+					       (src + 2 * i));
+		_mm256_storeu_si256((__m256i *) (dst + 2 * i),
+				    _mm256_shuffle_epi8(v, pairs));
+	}
+	swap_ssse3(dst + 2 * i, src + 2 * i, n - i);
+}
+
+#endif
+
+
+#ifdef BE16_NEON
+
+static void swap_neon(unsigned char *dst, const unsigned char *src,
+		      size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		vst1q_u8(dst + 2 * i, vrev16q_u8(vld1q_u8(src + 2 * i)));
+	swap_plain(dst + 2 * i, src + 2 * i, n - i);
+}
+
+#endif
+
+
+
+
+/*************************************************************************
+
+	swap_pairs
+
+	picks the best kernel for this CPU on the first call. Threads
+	that race on it all pick the same one; the pointer is read and
+	written atomically.
+
+**************************************************************************/
+
+typedef void (*swap_fn) (unsigned char *, const unsigned char *, size_t);
+
+static swap_fn pick_swap(void)
+{
+#ifdef BE16_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return (swap_avx2);
+	if (__builtin_cpu_supports("ssse3"))
+		return (swap_ssse3);
+#endif
+#ifdef BE16_NEON
+	return (swap_neon);
+#endif
+	return (swap_plain);
+}
+
+static void swap_pairs(unsigned char *dst, const unsigned char *src,
+		       size_t n)
+{
+	static swap_fn swap;
+	swap_fn fn;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	memcpy(dst, src, n * 2);
+	return;
+#endif
+	fn = __atomic_load_n(&swap, __ATOMIC_ACQUIRE);
+	if (!fn) {
+		fn = pick_swap();
+		__atomic_store_n(&swap, fn, __ATOMIC_RELEASE);
+	}
+	fn(dst, src, n);
+}
+
+
+
+
+void be16_decode(uint16_t *dest, const unsigned char *src, size_t n)
+{
+	swap_pairs((unsigned char *) dest, src, n);
+}
+
+void be16_encode(unsigned char *dest, const uint16_t *src, size_t n)
+{
+	swap_pairs(dest, (const unsigned char *) src, n);
+}
@@ -0,0 +1,58 @@
+/* 		modbus_be16.h
+
+   Conversion between the big endian registers of a Modbus frame and
+   uint16_t arrays in host order.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_BE16_H
+#define MODBUS_BE16_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/************************************************************************
+
+	be16_decode()	be16_encode()
+
+	decode n registers from the bytes of a frame (high byte
+	first) into dest, and encode n registers into frame bytes.
+	Neither buffer has to be aligned.
+
+	On x86 the bytes are swapped 32 at a time with AVX2, or 16 at
+	a time with SSSE3, whichever the CPU has; on ARM with NEON.
+	The choice is made at run time, so no special compiler flags
+	are needed.
+
+*************************************************************************/
+
+void be16_decode( uint16_t *dest, const unsigned char *src, size_t n );
+
+void be16_encode( unsigned char *dest, const uint16_t *src, size_t n );
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MODBUS_BE16_H */
@@ -0,0 +1,241 @@
+/* modbus_bits.c
+
+   Packing and unpacking of coil bits.
+
+   Unpacking turns every bit into a byte: pdep deposits the 8 bits of
+   a byte into the low bit of 8 bytes, pshufb (or NEON vdup) copies a
+   byte into 8 lanes that are then tested against 1, 2, 4 ... 128.
+   Packing goes the other way with movemask (or a NEON add across the
+   lanes). The tails are done bit by bit.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "modbus_bits.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITS_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define BITS_NEON
+#endif
+
+
+/* coils first .. count - 1, one at a time */
+static void unpack_plain(unsigned char *dest, const unsigned char *bits,
+			 size_t first, size_t count)
+{
+	size_t i;
+
+	for (i = first; i < count; i++)
+		dest[i] = (bits[i >> 3] >> (i & 7)) & 1;
+}
+
+static void pack_plain(unsigned char *bits, const unsigned char *src,
+		       size_t first, size_t count)
+{
+	size_t i;
+
+	for (i = first; i < count; i++) {
+		if (src[i])
+			bits[i >> 3] |= 1 << (i & 7);
+		else
+			bits[i >> 3] &= ~(1 << (i & 7));
+	}
+}
+
+
+#ifdef BITS_X86
+
+__attribute__((target("bmi2")))
+static void unpack_bmi2(unsigned char *dest, const unsigned char *bits,
+			size_t count)
+{
+	uint64_t v;
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		v = _pdep_u64(bits[i >> 3], 0x0101010101010101ULL);
+		memcpy(dest + i, &v, 8);
+	}
+	unpack_plain(dest, bits, i, count);
+}
+
+__attribute__((target("ssse3")))
+static void unpack_ssse3(unsigned char *dest, const unsigned char *bits,
+			 size_t count)
+{
+	const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+					     1, 1, 1, 1, 1, 1, 1, 1);
+	const __m128i lanes = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+					    1, 2, 4, 8, 16, 32, 64, -128);
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i v;
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		v = _mm_cvtsi32_si128(bits[i >> 3] | (bits[(i >> 3) + 1] << 8));
+		v = _mm_and_si128(_mm_shuffle_epi8(v, spread), lanes);
+		v = _mm_and_si128(_mm_cmpeq_epi8(v, lanes), one);
+		_mm_storeu_si128((__m128i *) (dest + i), v);
+	}
+	unpack_plain(dest, bits, i, count);
+}
+
+__attribute__((target("sse2")))
+static void pack_sse2(unsigned char *bits, const unsigned char *src,
+		      size_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+	int mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (src + i));
+		mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+		bits[i >> 3] = mask & 0xFF;
+		bits[(i >> 3) + 1] = (mask >> 8) & 0xFF;
+	}
+	pack_plain(bits, src, i, count);
+}
+
+#endif
+
+
+#ifdef BITS_NEON
+
+static const uint8_t neon_lanes[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+
+static void unpack_neon(unsigned char *dest, const unsigned char *bits,
+			size_t count)
+{
+	const uint8x8_t lanes = vld1_u8(neon_lanes);
+	const uint8x8_t one = vdup_n_u8(1);
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8)
+		vst1_u8(dest + i, vand_u8(vtst_u8(vdup_n_u8(bits[i >> 3]),
+						  lanes), one));
+	unpack_plain(dest, bits, i, count);
+}
+
+#ifdef __aarch64__
+static void pack_neon(unsigned char *bits, const unsigned char *src,
+		      size_t count)
+{
+	const uint8x8_t lanes = vld1_u8(neon_lanes);
+	uint8x8_t v;
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		v = vld1_u8(src + i);
+		bits[i >> 3] = vaddv_u8(vand_u8(vtst_u8(v, v), lanes));
+	}
+	pack_plain(bits, src, i, count);
+}
+#endif
+
+#endif
+
+
+
+
+/*************************************************************************
+
+	bits_unpack / bits_pack
+
+	pick the kernel for this CPU on the first call.
+
+**************************************************************************/
+
+typedef void (*bits_fn) (unsigned char *, const unsigned char *, size_t);
+
+static void unpack_all_plain(unsigned char *dest, const unsigned char *bits,
+			     size_t count)
+{
+	unpack_plain(dest, bits, 0, count);
+}
+
+static void pack_all_plain(unsigned char *bits, const unsigned char *src,
+			   size_t count)
+{
+	pack_plain(bits, src, 0, count);
+}
+
+static bits_fn pick_unpack(void)
+{
+#ifdef BITS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("bmi2"))
+		return (unpack_bmi2);
+	if (__builtin_cpu_supports("ssse3"))
+		return (unpack_ssse3);
+#endif
+#ifdef BITS_NEON
+	return (unpack_neon);
+#endif
+	return (unpack_all_plain);
+}
+
+static bits_fn pick_pack(void)
+{
+#ifdef BITS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		return (pack_sse2);
+#endif
+#if defined(BITS_NEON) && defined(__aarch64__)
+	return (pack_neon);
+#endif
+	return (pack_all_plain);
+}
+
+void bits_unpack(unsigned char *dest, const unsigned char *bits,
+		 size_t count)
+{
+	static bits_fn unpack;
+	bits_fn fn;
+
+	/* picked on the first call; threads that race on it all pick */
+	/* the same one                                               */
+	fn = __atomic_load_n(&unpack, __ATOMIC_ACQUIRE);
+	if (!fn) {
+		fn = pick_unpack();
+		__atomic_store_n(&unpack, fn, __ATOMIC_RELEASE);
+	}
+	fn(dest, bits, count);
+}
+
+void bits_pack(unsigned char *bits, const unsigned char *src, size_t count)
+{
+	static bits_fn pack;
+	bits_fn fn;
+
+	fn = __atomic_load_n(&pack, __ATOMIC_ACQUIRE);
+	if (!fn) {
+		fn = pick_pack();
+		__atomic_store_n(&pack, fn, __ATOMIC_RELEASE);
+	}
+	fn(bits, src, count);
+
+	/* the padding of the last byte goes out as zeros */
+	if (count & 7)
+		bits[count >> 3] &= (1 << (count & 7)) - 1;
+}
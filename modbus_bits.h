@@ -0,0 +1,65 @@
+/* 		modbus_bits.h
+
+   Coils and discrete inputs kept as packed bits, the way they travel
+   in FC01, FC02 and FC15 frames: coil n of a block is bit n % 8 of
+   byte n / 8, least significant bit first.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_BITS_H
+#define MODBUS_BITS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* bytes needed for count packed coils; also the FC01/02/15 byte count */
+#define COIL_BYTES(count) (((count) + 7) / 8)
+
+
+
+/************************************************************************
+
+	bits_unpack()	bits_pack()
+
+	bits_unpack() sets dest[i] to 1 or 0 from coil i of a packed
+	block; bits_pack() does the reverse, any non zero byte being
+	an ON coil, and clears the unused bits of the last byte. A C++
+	bool array can be passed as the byte array.
+
+	On x86 unpacking uses BMI2 pdep, or SSSE3 pshufb, and packing
+	SSE2 movemask. On ARM NEON unpacks, and packs on AArch64. The
+	choice is made at run time.
+
+*************************************************************************/
+
+void bits_unpack( unsigned char *dest, const unsigned char *bits,
+		  size_t count );
+
+void bits_pack( unsigned char *bits, const unsigned char *src,
+		size_t count );
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MODBUS_BITS_H */
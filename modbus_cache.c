@@ -0,0 +1,382 @@
+/* modbus_cache.c
+
+   Cache in front of the read calls of the RTU master.
+
+   The entries form an open addressed hash table on (port, slave,
+   table, address). A key is looked for in PROBE_LIMIT slots from its
+   hash; when they are all taken by other keys the oldest of them is
+   reused, so a full cache forgets the values read longest ago. Entries
+   are never removed, only marked stale, so probing needs no tombstones.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include <time.h>
+#include "modbus_rtu.h"
+#include "modbus_cache.h"
+
+#define PROBE_LIMIT 8
+
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+static unsigned int hash_key(int fd, int slave, int table, int addr)
+{
+	unsigned int h;
+
+	h = (unsigned) addr * 0x9E3779B1u;
+	h ^= ((unsigned) fd << 16) ^ ((unsigned) slave << 8) ^ table;
+	h *= 0x85EBCA6Bu;
+	return (h ^ (h >> 15));
+}
+
+static int same_key(struct cache_entry *e, int fd, int slave, int table,
+		    int addr)
+{
+	return (e->table == table && e->addr == addr && e->slave == slave
+		&& e->fd == fd);
+}
+
+
+
+
+/************************************************************************
+
+	lookup / slot_for
+
+	lookup finds the entry of a key, NULL if it is not cached.
+	slot_for finds the entry to store a key in: its own, a free
+	one, or the oldest one in the probe window; NULL in a cache
+	without entries.
+
+*************************************************************************/
+
+static struct cache_entry *lookup(struct reg_cache *cache, int fd,
+				  int slave, int table, int addr)
+{
+	struct cache_entry *e;
+	unsigned int i, h;
+
+	if (cache->n_entries <= 0)
+		return (NULL);
+
+	h = hash_key(fd, slave, table, addr);
+	for (i = 0; i < PROBE_LIMIT; i++) {
+		e = &cache->entries[(h + i) % cache->n_entries];
+		if (e->table == 0)
+			return (NULL);
+		if (same_key(e, fd, slave, table, addr))
+			return (e);
+	}
+	return (NULL);
+}
+
+static struct cache_entry *slot_for(struct reg_cache *cache, int fd,
+				    int slave, int table, int addr)
+{
+	struct cache_entry *e, *oldest = NULL;
+	unsigned int i, h;
+
+	if (cache->n_entries <= 0)
+		return (NULL);
+
+	h = hash_key(fd, slave, table, addr);
+	for (i = 0; i < PROBE_LIMIT; i++) {
+		e = &cache->entries[(h + i) % cache->n_entries];
+		if (e->table == 0 || same_key(e, fd, slave, table, addr))
+			return (e);
+		if (!oldest || e->stamp < oldest->stamp)
+			oldest = e;
+	}
+	return (oldest);
+}
+
+
+
+
+/************************************************************************
+
+	max_age
+
+	of an address: the last rule added that covers it, else the
+	default.
+
+*************************************************************************/
+
+static long max_age(struct reg_cache *cache, int slave, int table, int addr)
+{
+	struct cache_rule *r;
+	int i;
+
+	for (i = cache->n_rules - 1; i >= 0; i--) {
+		r = &cache->rules[i];
+		if ((r->slave == 0 || r->slave == slave)
+		    && (r->table == 0 || r->table == table)
+		    && addr >= r->start_addr
+		    && (r->count == 0 || addr < r->start_addr + r->count))
+			return (r->max_age);
+	}
+	return (cache->default_age);
+}
+
+
+
+
+/* writes drop what they touched: FC05/15 the coils, FC06/16/23 */
+/* the holding registers                                         */
+static void cache_write_hook(void *arg, int fd, int slave, int function,
+			     int addr, int count)
+{
+	int table = (function == 0x05 || function == 0x0F) ? 0x01 : 0x03;
+
+	cache_invalidate(arg, fd, slave, table, addr, count);
+}
+
+
+
+
+/************************************************************************
+
+	cache_init / cache_set_age
+
+*************************************************************************/
+
+void cache_init(struct reg_cache *cache, struct cache_entry *entries,
+		int n_entries, long default_age)
+{
+	int i;
+
+	if (n_entries < 0)
+		n_entries = 0;
+
+	cache->entries = entries;
+	cache->n_entries = n_entries;
+	cache->default_age = default_age;
+	cache->n_rules = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->reads = 0;
+	cache->invalidated = 0;
+
+	for (i = 0; i < n_entries; i++) {
+		entries[i].table = 0;
+		entries[i].stamp = 0;
+	}
+
+	set_write_hook(cache_write_hook, cache);
+}
+
+int cache_set_age(struct reg_cache *cache, int slave, int table,
+		  int start_addr, int count, long max_age)
+{
+	struct cache_rule *r;
+
+	if (cache->n_rules >= MAX_CACHE_RULES)
+		return (-1);
+
+	r = &cache->rules[cache->n_rules++];
+	r->slave = slave;
+	r->table = table;
+	r->start_addr = start_addr;
+	r->count = count;
+	r->max_age = max_age;
+	return (0);
+}
+
+
+
+
+/************************************************************************
+
+	cache_read
+
+	serves the fresh addresses from the cache and reads each run of
+	the others with one request, up to the protocol limit.
+
+*************************************************************************/
+
+static int cache_read(struct reg_cache *cache, int table, int slave,
+		      int start_addr, int count, int *dest, int dest_size,
+		      int fd)
+{
+	struct cache_entry *e;
+	long long now, stamp;
+	long age;
+	int i, j, n, limit, status;
+	int bits = (table == 0x01 || table == 0x02);
+
+	limit = bits ? MAX_PDU_READ_BITS : MAX_PDU_READ_REGS;
+	if (count > dest_size)
+		count = dest_size;
+
+	now = now_us();
+	for (i = 0; i < count; i = j + n) {
+		age = max_age(cache, slave, table, start_addr + i);
+		e = lookup(cache, fd, slave, table, start_addr + i);
+		if (age > 0 && e && e->stamp && now - e->stamp <= age) {
+			dest[i] = e->value;
+			cache->hits++;
+			j = i;
+			n = 1;
+			continue;
+		}
+
+		/* the run of addresses that are not fresh */
+		j = i;
+		for (n = 1; j + n < count && n < limit; n++) {
+			age = max_age(cache, slave, table, start_addr + j + n);
+			e = lookup(cache, fd, slave, table,
+				   start_addr + j + n);
+			if (age > 0 && e && e->stamp
+			    && now - e->stamp <= age)
+				break;
+		}
+		cache->misses += n;
+		cache->reads++;
+
+		if (bits)
+			status = read_IO_status(table, slave, start_addr + j,
+						n, dest + j, n, fd);
+		else
+			status = read_registers(table, slave, start_addr + j,
+						n, dest + j, n, fd);
+		if (status <= 0)
+			return (status);
+
+		stamp = now_us();
+		for (i = j; i < j + n; i++) {
+			if (max_age(cache, slave, table, start_addr + i) <= 0)
+				continue;
+			e = slot_for(cache, fd, slave, table, start_addr + i);
+			if (!e)
+				break;
+			e->fd = fd;
+			e->slave = slave;
+			e->table = table;
+			e->addr = start_addr + i;
+			e->value = dest[i];
+			e->stamp = stamp;
+		}
+	}
+
+	/* what the blocking call returns for a complete reply */
+	if (bits)
+		return (3 + (count + 7) / 8 + 2);
+	return (3 + count * 2);
+}
+
+
+int cache_read_coil_status(struct reg_cache *cache, int slave,
+			   int start_addr, int count,
+			   int *dest, int dest_size, int fd)
+{
+	return (cache_read(cache, 0x01, slave, start_addr, count,
+			   dest, dest_size, fd));
+}
+
+int cache_read_input_status(struct reg_cache *cache, int slave,
+			    int start_addr, int count,
+			    int *dest, int dest_size, int fd)
+{
+	return (cache_read(cache, 0x02, slave, start_addr, count,
+			   dest, dest_size, fd));
+}
+
+int cache_read_holding_registers(struct reg_cache *cache, int slave,
+				 int start_addr, int count,
+				 int *dest, int dest_size, int fd)
+{
+	return (cache_read(cache, 0x03, slave, start_addr, count,
+			   dest, dest_size, fd));
+}
+
+int cache_read_input_registers(struct reg_cache *cache, int slave,
+			       int start_addr, int count,
+			       int *dest, int dest_size, int fd)
+{
+	return (cache_read(cache, 0x04, slave, start_addr, count,
+			   dest, dest_size, fd));
+}
+
+
+
+
+/************************************************************************
+
+	cache_invalidate
+
+	slave 0 (a broadcast) drops the range for every slave on the
+	port, which needs a scan of the whole table.
+
+*************************************************************************/
+
+void cache_invalidate(struct reg_cache *cache, int fd, int slave,
+		      int table, int start_addr, int count)
+{
+	struct cache_entry *e;
+	int i, t;
+
+	if (slave == 0) {
+		for (i = 0; i < cache->n_entries; i++) {
+			e = &cache->entries[i];
+			if (e->stamp && e->fd == fd
+			    && (table == 0 || e->table == table)
+			    && e->addr >= start_addr
+			    && e->addr < start_addr + count) {
+				e->stamp = 0;
+				cache->invalidated++;
+			}
+		}
+		return;
+	}
+
+	for (t = 0x01; t <= 0x04; t++) {
+		if (table != 0 && table != t)
+			continue;
+		for (i = 0; i < count; i++) {
+			e = lookup(cache, fd, slave, t, start_addr + i);
+			if (e && e->stamp) {
+				e->stamp = 0;
+				cache->invalidated++;
+			}
+		}
+	}
+}
+
+
+
+
+/************************************************************************
+
+	cache_report
+
+*************************************************************************/
+
+void cache_report(struct reg_cache *cache, FILE *out)
+{
+	unsigned long total = cache->hits + cache->misses;
+
+	fprintf(out, "hits %lu misses %lu (%.1f%% hit) bus reads %lu "
+		"invalidated %lu\n", cache->hits, cache->misses,
+		total ? 100.0 * cache->hits / total : 0.0,
+		cache->reads, cache->invalidated);
+}
@@ -0,0 +1,196 @@
+/* 		modbus_cache.h
+
+   Cache in front of the read calls of the RTU master.
+
+   Values read from a slave are kept per (port, slave, table, address)
+   for a configurable time. A read that finds every address fresh in
+   the cache does not go to the bus at all; a read that finds some of
+   them only fetches the runs that are missing or too old. Writes the
+   slave accepts, through the blocking calls or an rtu_loop, drop the
+   addresses they touched from the cache.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_CACHE_H
+#define MODBUS_CACHE_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/************************************************************************
+
+	struct cache_entry
+
+	one cached value. The caller provides an array of them to
+	cache_init(); a few times the number of points read is plenty.
+
+*************************************************************************/
+
+struct cache_entry {
+	int fd;
+	int slave;
+	int table;		/* function code of the read, 0x01 to 0x04 */
+	int addr;
+	int value;
+	long long stamp;	/* uS, CLOCK_MONOTONIC; 0 if not valid */
+};
+
+
+
+/************************************************************************
+
+	struct cache_rule
+
+	how long values stay fresh. slave 0 and table 0 match any;
+	count 0 covers the whole table from start_addr on. A max_age
+	of 0 turns caching off for the addresses covered.
+
+*************************************************************************/
+
+#define MAX_CACHE_RULES 16
+
+struct cache_rule {
+	int slave;
+	int table;
+	int start_addr;
+	int count;
+	long max_age;		/* uS */
+};
+
+
+
+/************************************************************************
+
+	struct reg_cache
+
+	hits and misses count addresses, reads counts the requests
+	that went to the bus, invalidated the addresses dropped
+	because of writes.
+
+*************************************************************************/
+
+struct reg_cache {
+	struct cache_entry *entries;
+	int n_entries;
+	long default_age;	/* uS, for addresses no rule covers */
+	struct cache_rule rules[MAX_CACHE_RULES];
+	int n_rules;
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long reads;
+	unsigned long invalidated;
+};
+
+
+
+/************************************************************************
+
+	cache_init()
+
+	empties the cache and installs it as the write hook (see
+	set_write_hook()), so only one cache can be in use at a time.
+	default_age is in uS. With n_entries 0 (entries may then be
+	NULL) nothing is cached and every read goes to the slave.
+
+*************************************************************************/
+
+void cache_init( struct reg_cache *cache, struct cache_entry *entries,
+		 int n_entries, long default_age );
+
+
+
+/************************************************************************
+
+	cache_set_age()
+
+	adds a rule. When several rules cover an address the one added
+	last wins, so add the general ones first.
+
+	Returns:	0 if OK, -1 if there is no room for another rule
+
+*************************************************************************/
+
+int cache_set_age( struct reg_cache *cache, int slave, int table,
+		   int start_addr, int count, long max_age );
+
+
+
+/************************************************************************
+
+	cache_read_coil_status()	cache_read_input_status()
+	cache_read_holding_registers()	cache_read_input_registers()
+
+	same as the calls without cache_ and the same return values.
+	count is cut to dest_size. Missing addresses are fetched in
+	as few requests as their runs allow.
+
+*************************************************************************/
+
+int cache_read_coil_status( struct reg_cache *cache, int slave,
+			    int start_addr, int count,
+			    int *dest, int dest_size, int fd );
+
+int cache_read_input_status( struct reg_cache *cache, int slave,
+			     int start_addr, int count,
+			     int *dest, int dest_size, int fd );
+
+int cache_read_holding_registers( struct reg_cache *cache, int slave,
+				  int start_addr, int count,
+				  int *dest, int dest_size, int fd );
+
+int cache_read_input_registers( struct reg_cache *cache, int slave,
+				int start_addr, int count,
+				int *dest, int dest_size, int fd );
+
+
+
+/************************************************************************
+
+	cache_invalidate()
+
+	drops addresses from the cache; table 0 drops them from all
+	four tables of the slave.
+
+*************************************************************************/
+
+void cache_invalidate( struct reg_cache *cache, int fd, int slave,
+		       int table, int start_addr, int count );
+
+
+
+/************************************************************************
+
+	cache_report()
+
+	prints the counters and the hit rate.
+
+*************************************************************************/
+
+void cache_report( struct reg_cache *cache, FILE *out );
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MODBUS_CACHE_H */
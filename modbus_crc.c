@@ -0,0 +1,171 @@
+/* modbus_crc.c
+
+   Table driven CRC-16 for Modbus RTU frames.
+
+   The register is the usual reflected 0xA001 polynomial preset to
+   0xFFFF, exactly what the old bit by bit loop in crc() computed, but
+   done a byte (or eight bytes) at a time from lookup tables.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include "modbus_crc.h"
+
+#ifdef __AVR__
+
+#include <avr/pgmspace.h>
+
+/* 16 entries, 32 bytes of flash: two lookups per byte. */
+static const unsigned short crc_nibble[16] PROGMEM = {
+	0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+	0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
+};
+
+unsigned short crc16_update(unsigned short temp, const unsigned char *buf,
+			    size_t len)
+{
+	while (len--) {
+		temp ^= *buf++;
+		temp = (temp >> 4) ^ pgm_read_word(&crc_nibble[temp & 0x0F]);
+		temp = (temp >> 4) ^ pgm_read_word(&crc_nibble[temp & 0x0F]);
+	}
+	return (temp);
+}
+
+#else
+
+/*************************************************************************
+
+	crc_table
+
+	crc_table[0][b] is the CRC register after shifting the byte b
+	through an empty register. crc_table[k][b] is the same byte
+	followed by k zero bytes; those are only used by crc16_slice8().
+
+**************************************************************************/
+
+static unsigned short crc_table[8][256] = { {
+	0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+	0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+	0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+	0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+	0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+	0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+	0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+	0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+	0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+	0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+	0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+	0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+	0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+	0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+	0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+	0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+	0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+	0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+	0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+	0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+	0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+	0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+	0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+	0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+	0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+	0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+	0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+	0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+	0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+	0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+	0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+	0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040,
+} };
+
+/* fill crc_table[1..7] from crc_table[0] before main() runs */
+static void __attribute__ ((constructor)) crc_table_init(void)
+{
+	int k, b;
+
+	for (k = 1; k < 8; k++) {
+		for (b = 0; b < 256; b++) {
+			unsigned short prev = crc_table[k - 1][b];
+			crc_table[k][b] = (prev >> 8) ^ crc_table[0][prev & 0xFF];
+		}
+	}
+}
+
+
+unsigned short crc16_update(unsigned short temp, const unsigned char *buf,
+			    size_t len)
+{
+	while (len--)
+		temp = (temp >> 8) ^ crc_table[0][(temp ^ *buf++) & 0xFF];
+
+	return (temp);
+}
+
+
+unsigned short crc16_slice8(const unsigned char *buf, size_t len)
+{
+	unsigned short temp = 0xFFFF;
+	unsigned short lo;
+
+	while (len >= 8) {
+		lo = temp ^ (buf[0] | (buf[1] << 8));
+		temp = crc_table[7][lo & 0xFF] ^ crc_table[6][lo >> 8] ^
+		    crc_table[5][buf[2]] ^ crc_table[4][buf[3]] ^
+		    crc_table[3][buf[4]] ^ crc_table[2][buf[5]] ^
+		    crc_table[1][buf[6]] ^ crc_table[0][buf[7]];
+		buf += 8;
+		len -= 8;
+	}
+
+	return (crc16_update(temp, buf, len));
+}
+
+#endif  /* __AVR__ */
+
+
+unsigned short crc16(const unsigned char *buf, size_t len)
+{
+	return (crc16_update(0xFFFF, buf, len));
+}
+
+
+
+/****************************************************************************
+***************************** [  BEGIN:  crc ] ******************************
+*****************************************************************************
+INPUTS:
+	buf   ->  Array containing message to be sent to controller.
+	start ->  Start of loop in crc counter, usually 0.
+	cnt   ->  Amount of bytes in message being sent to controller/
+OUTPUTS:
+	temp  ->  Returns crc byte for message.
+COMMENTS:
+	This routine calculates the crc high and low byte of a message.
+	Note that this crc is only used for Modbus, not Modbus+ etc. 
+	The result is byte swapped so that temp >> 8 is the first CRC
+	byte on the wire.
+****************************************************************************/
+
+unsigned int crc(unsigned char *buf, int start, int cnt)
+{
+	unsigned temp;
+
+	temp = (cnt > start) ? crc16(buf + start, cnt - start) : 0xFFFF;
+
+	/* Reverse byte order. */
+	return (((temp << 8) | (temp >> 8)) & 0xFFFF);
+}
@@ -0,0 +1,87 @@
+/* 		modbus_crc.h
+
+   CRC-16 used to protect every Modbus RTU frame.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_CRC_H
+#define MODBUS_CRC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/************************************************************************
+
+	crc16()
+
+	returns the CRC register for len bytes of buf. The low byte
+	of the result is sent first on the wire. On Linux a 256 entry
+	table is used, on AVR a 16 entry table kept in PROGMEM.
+
+	crc16_update() carries on from a previous register value, so a
+	frame can be checked in pieces: start from 0xFFFF.
+
+*************************************************************************/
+
+unsigned short crc16( const unsigned char *buf, size_t len );
+
+unsigned short crc16_update( unsigned short temp,
+			     const unsigned char *buf, size_t len );
+
+
+
+#ifndef __AVR__
+
+/************************************************************************
+
+	crc16_slice8()
+
+	same result as crc16() but eats eight bytes per step from 8
+	tables (4 Kbytes). Meant for bulk verification of long frames
+	or captured traffic. Run ./crcbench for the numbers.
+
+*************************************************************************/
+
+unsigned short crc16_slice8( const unsigned char *buf, size_t len );
+
+#endif
+
+
+
+/************************************************************************
+
+	crc()
+
+	the original interface: CRC of buf[start] .. buf[cnt - 1] with
+	the two bytes swapped, i.e. (crc >> 8) is the first byte on the
+	wire.
+
+*************************************************************************/
+
+unsigned int crc( unsigned char *buf, int start, int cnt );
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MODBUS_CRC_H */
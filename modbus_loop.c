@@ -0,0 +1,533 @@
+/* modbus_loop.c
+
+   Non-blocking Modbus RTU transactions on many buses from one thread.
+
+   Each bus is a small state machine:
+
+	BUS_IDLE   nothing on the wire
+	BUS_GAP    a query is waiting for the t3.5 gap to end
+	BUS_REPLY  a query has been sent, collecting the reply
+
+   The serial fd wakes us up when reply bytes arrive; the bus timerfd
+   wakes us up at the end of the gap, when a reply is overdue, and
+   after t3.5 of silence when the reply length is not known. Framing
+   and checks are the ones receive_response() and modbus_response()
+   use.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include "modbus_loop.h"
+#include "modbus_port.h"
+#include "modbus_trace.h"
+
+#define MAX_EVENTS 64
+
+enum {
+	BUS_IDLE,
+	BUS_GAP,
+	BUS_REPLY
+};
+
+
+static void ts_add_ns(struct timespec *ts, long ns)
+{
+	ts->tv_sec += ns / 1000000000L;
+	ts->tv_nsec += ns % 1000000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec
+		|| (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec));
+}
+
+/* fire the bus timer at an absolute CLOCK_MONOTONIC time */
+static void arm_timer(struct rtu_bus *bus, const struct timespec *when)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value = *when;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;	/* zero would disarm it */
+	timerfd_settime(bus->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* watch the serial fd for input only while the bus has the port; */
+/* the rest of the time the bytes are a blocking caller's reply    */
+static void watch_rx(struct rtu_bus *bus, int on)
+{
+	struct epoll_event ev;
+
+	ev.events = on ? EPOLLIN : 0;
+	ev.data.ptr = &bus->rx_watch;
+	epoll_ctl(bus->loop->epfd, EPOLL_CTL_MOD, bus->fd, &ev);
+}
+
+/* fire the bus timer ns from now */
+static void arm_timer_in(struct rtu_bus *bus, long ns)
+{
+	struct timespec when;
+
+	clock_gettime(CLOCK_MONOTONIC, &when);
+	ts_add_ns(&when, ns);
+	arm_timer(bus, &when);
+}
+
+
+
+
+/************************************************************************
+
+	write_query
+
+	writes the whole query. The tty output buffer is far bigger
+	than a frame, so this practically never has to wait.
+
+*************************************************************************/
+
+static int write_query(int fd, unsigned char *query, int length)
+{
+	struct pollfd pfd;
+	int sent = 0, n;
+
+	while (sent < length) {
+		n = write(fd, query + sent, length - sent);
+		if (n < 0 && errno == EAGAIN) {
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, 10);
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (PORT_FAILURE);
+		sent += n;
+	}
+	return (sent);
+}
+
+
+
+
+static void start_next(struct rtu_bus *bus);
+
+/************************************************************************
+
+	finish
+
+	ends the transaction on the wire and starts the next one.
+
+*************************************************************************/
+
+static void finish(struct rtu_bus *bus, int status)
+{
+	struct rtu_txn *txn = bus->cur;
+
+	struct timespec gap;
+
+	bus->cur = NULL;
+	bus->state = BUS_IDLE;
+	clock_gettime(CLOCK_MONOTONIC, &gap);
+	ts_add_ns(&gap, bus->timing.t35 * 1000L);
+	if (ts_before(&bus->idle_at, &gap))
+		bus->idle_at = gap;
+	bus->loop->pending--;
+
+	/* the blocking calls wait for the same gap */
+	bus->port->idle_at = bus->idle_at;
+	bus->holding = 0;
+	watch_rx(bus, 0);
+	port_release(bus->port, status, txn->response_length);
+
+	txn->times.done = stats_now();
+	if (txn->response_length > 0)
+		trace_frame(TRACE_RX, bus->fd, txn->response,
+			    txn->response_length);
+	else if (status == COMMS_FAILURE)
+		trace_frame(TRACE_TIMEOUT, bus->fd, NULL, 0);
+	stats_record(txn->query, &txn->times, status, txn->response_length);
+	report_write(bus->fd, txn->query, status);
+	txn->done(txn, status);
+
+	start_next(bus);
+}
+
+
+
+
+/************************************************************************
+
+	start_next
+
+	puts the first waiting query on the wire, or arms the timer
+	for the end of the t3.5 gap if it is not over yet.
+
+*************************************************************************/
+
+static void start_next(struct rtu_bus *bus)
+{
+	struct rtu_txn *txn;
+	struct timespec now;
+	long length_ns, gap;
+	int length, status;
+
+	if (bus->cur || !bus->head)
+		return;
+
+	/* take the port as the blocking calls do, without waiting; */
+	/* if one of them has it, look again after t3.5             */
+	if (!bus->holding) {
+		if (!port_try_acquire(bus->port)) {
+			bus->state = BUS_GAP;
+			arm_timer_in(bus, bus->timing.t35 * 1000L);
+			return;
+		}
+		bus->holding = 1;
+		watch_rx(bus, 1);
+		if (ts_before(&bus->idle_at, &bus->port->idle_at))
+			bus->idle_at = bus->port->idle_at;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (ts_before(&now, &bus->idle_at)) {
+		bus->state = BUS_GAP;
+		arm_timer(bus, &bus->idle_at);
+		return;
+	}
+
+	txn = bus->head;
+	bus->head = txn->next;
+	if (!bus->head)
+		bus->tail = NULL;
+	txn->next = NULL;
+	bus->cur = txn;
+	txn->response_length = 0;
+
+	length = txn->query_length + 2;
+	tcflush(bus->fd, TCIFLUSH);	/* no stale bytes in the reply */
+
+	/* RTS up for transmission, as send_query() does */
+	ioctl(bus->fd, TIOCMGET, &status);
+	status |= TIOCM_RTS;
+	ioctl(bus->fd, TIOCMSET, &status);
+	memset(&txn->times, 0, sizeof(txn->times));
+	txn->times.tx_start = stats_now();
+	if (write_query(bus->fd, txn->query, length) < 0) {
+		finish(bus, PORT_FAILURE);
+		return;
+	}
+	txn->times.tx_end = stats_now();
+	trace_frame(TRACE_TX, bus->fd, txn->query, length);
+
+	/* the query is on the wire for length characters; the */
+	/* reply has timeout from then on to show up           */
+	length_ns = length * bus->timing.char_ns;
+	clock_gettime(CLOCK_MONOTONIC, &bus->idle_at);
+
+	if (txn->query[0] == BROADCAST_ADDRESS) {
+		/* no reply; the slaves get their turnaround delay */
+		gap = bus->timing.t35 * 1000L;
+		if (gap < bus->broadcast_delay * 1000L)
+			gap = bus->broadcast_delay * 1000L;
+		ts_add_ns(&bus->idle_at, length_ns + gap);
+		finish(bus, broadcast_status(txn->query));
+		return;
+	}
+	ts_add_ns(&bus->idle_at, length_ns + bus->timing.t35 * 1000L);
+
+	bus->state = BUS_REPLY;
+	arm_timer_in(bus, length_ns
+		     + (txn->timeout ? txn->timeout : 1000000L) * 1000L);
+}
+
+
+
+
+/************************************************************************
+
+	on_readable
+
+	collects reply bytes; the transaction is done as soon as the
+	frame is complete.
+
+*************************************************************************/
+
+static void on_readable(struct rtu_bus *bus)
+{
+	struct rtu_txn *txn = bus->cur;
+	unsigned char junk[MAX_RESPONSE_LENGTH];
+	int n, wanted, missing;
+
+	if (bus->state != BUS_REPLY) {
+		/* nobody asked for these */
+		while (read(bus->fd, junk, sizeof(junk)) > 0);
+		return;
+	}
+
+	wanted = (txn->expected ? txn->expected : MAX_RESPONSE_LENGTH)
+	    - txn->response_length;
+	if (wanted > MAX_RESPONSE_LENGTH - txn->response_length)
+		wanted = MAX_RESPONSE_LENGTH - txn->response_length;
+	n = read(bus->fd, txn->response + txn->response_length, wanted);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			finish(bus, PORT_FAILURE);
+		return;
+	}
+	if (n > 0) {
+		txn->times.rx_last = stats_now();
+		if (!txn->response_length)
+			txn->times.rx_first = txn->times.rx_last;
+	}
+	txn->response_length += n;
+
+	txn->expected = frame_length(txn->response, txn->response_length,
+				     txn->expected);
+
+	/* a full buffer is never a good frame, as in receive_response() */
+	if (txn->response_length >= MAX_RESPONSE_LENGTH) {
+		finish(bus, PORT_FAILURE);
+		return;
+	}
+	if (txn->expected && txn->response_length >= txn->expected) {
+		finish(bus, check_response(txn->response,
+					   txn->response_length,
+					   txn->query));
+		return;
+	}
+
+	/* a known length frame gets the wire time of what is missing, */
+	/* an unknown one ends after t3.5 of silence                   */
+	if (txn->expected) {
+		missing = txn->expected - txn->response_length;
+		arm_timer_in(bus, missing * bus->timing.char_ns
+			     + (bus->timing.t35 + RX_LATENCY_SLACK) * 1000L);
+	} else {
+		arm_timer_in(bus, bus->timing.t35 * 1000L);
+	}
+}
+
+
+
+
+/************************************************************************
+
+	on_timer
+
+	end of the gap, or a reply that stopped coming.
+
+*************************************************************************/
+
+static void on_timer(struct rtu_bus *bus)
+{
+	uint64_t expirations;
+	struct rtu_txn *txn = bus->cur;
+
+	if (read(bus->timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;		/* re-armed since, not due any more */
+
+	switch (bus->state) {
+	case BUS_GAP:
+		bus->state = BUS_IDLE;
+		start_next(bus);
+		break;
+	case BUS_REPLY:
+		if (txn->response_length > 0 && txn->expected == 0)
+			finish(bus, check_response(txn->response,
+						   txn->response_length,
+						   txn->query));
+		else
+			finish(bus, COMMS_FAILURE);
+		break;
+	}
+}
+
+
+
+
+/************************************************************************
+
+	rtu_loop_init / rtu_loop_close
+
+*************************************************************************/
+
+int rtu_loop_init(struct rtu_loop *loop)
+{
+	loop->pending = 0;
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0)
+		return (PORT_FAILURE);
+	return (0);
+}
+
+void rtu_loop_close(struct rtu_loop *loop)
+{
+	close(loop->epfd);
+	loop->epfd = -1;
+}
+
+
+
+
+/************************************************************************
+
+	rtu_bus_add / rtu_bus_remove
+
+*************************************************************************/
+
+int rtu_bus_add(struct rtu_loop *loop, struct rtu_bus *bus, int fd)
+{
+	struct epoll_event ev;
+	struct modbus_port port;
+
+	memset(bus, 0, sizeof(*bus));
+	bus->fd = fd;
+	bus->loop = loop;
+	bus->state = BUS_IDLE;
+	if (get_line_timing(fd, &bus->timing) < 0)
+		return (PORT_FAILURE);
+	bus->port = port_of(fd);
+	if (!bus->port)
+		return (PORT_FAILURE);
+	clock_gettime(CLOCK_MONOTONIC, &bus->idle_at);
+	if (port_info(fd, &port) == 0)
+		bus->broadcast_delay = port.broadcast_delay;
+	else
+		bus->broadcast_delay = BROADCAST_DELAY;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	bus->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				       TFD_NONBLOCK | TFD_CLOEXEC);
+	if (bus->timer_fd < 0)
+		return (PORT_FAILURE);
+
+	bus->rx_watch.bus = bus;
+	bus->rx_watch.is_timer = 0;
+	bus->timer_watch.bus = bus;
+	bus->timer_watch.is_timer = 1;
+
+	ev.events = 0;		/* see watch_rx() */
+	ev.data.ptr = &bus->rx_watch;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		goto fail;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &bus->timer_watch;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, bus->timer_fd, &ev) < 0) {
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+		goto fail;
+	}
+	return (0);
+
+      fail:
+	close(bus->timer_fd);
+	return (PORT_FAILURE);
+}
+
+void rtu_bus_remove(struct rtu_bus *bus)
+{
+	epoll_ctl(bus->loop->epfd, EPOLL_CTL_DEL, bus->fd, NULL);
+	epoll_ctl(bus->loop->epfd, EPOLL_CTL_DEL, bus->timer_fd, NULL);
+	close(bus->timer_fd);
+	if (bus->holding) {
+		bus->holding = 0;
+		port_release(bus->port, PORT_FAILURE, 0);
+	}
+}
+
+
+
+
+/************************************************************************
+
+	rtu_bus_submit
+
+*************************************************************************/
+
+void rtu_bus_submit(struct rtu_bus *bus, struct rtu_txn *txn)
+{
+	modbus_query(txn->query, txn->query_length);
+	txn->expected = expected_response_length(txn->query);
+	txn->response_length = 0;
+	txn->next = NULL;
+
+	if (bus->tail)
+		bus->tail->next = txn;
+	else
+		bus->head = txn;
+	bus->tail = txn;
+	bus->loop->pending++;
+
+	if (bus->state == BUS_IDLE)
+		start_next(bus);
+}
+
+
+
+
+/************************************************************************
+
+	rtu_loop_dispatch / rtu_loop_run
+
+*************************************************************************/
+
+int rtu_loop_dispatch(struct rtu_loop *loop, int timeout_ms)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct rtu_watch *watch;
+	int i, n;
+
+	n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout_ms);
+	if (n < 0 && errno != EINTR)
+		return (PORT_FAILURE);
+
+	for (i = 0; i < n; i++) {
+		watch = events[i].data.ptr;
+		if (watch->is_timer)
+			on_timer(watch->bus);
+		else
+			on_readable(watch->bus);
+	}
+
+	return (loop->pending);
+}
+
+int rtu_loop_run(struct rtu_loop *loop)
+{
+	int status = loop->pending;
+
+	while (status > 0)
+		status = rtu_loop_dispatch(loop, -1);
+
+	return (status);
+}
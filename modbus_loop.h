@@ -0,0 +1,190 @@
+/* 		modbus_loop.h
+
+   Event loop running Modbus RTU transactions on many serial lines
+   from one thread.
+
+   Each bus has one transaction on the wire at a time and a queue of
+   the ones waiting. All buses of a loop wait in the same epoll_wait(),
+   with a timerfd per bus for the t3.5 gap and the reply timeouts, so
+   a slow slave on one segment does not hold up the others. For more
+   buses than one core can handle, run one loop per thread and spread
+   the buses over them; loops share nothing.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_LOOP_H
+#define MODBUS_LOOP_H
+
+#include <time.h>
+#include "modbus_rtu.h"
+#include "modbus_stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+struct rtu_txn;
+struct rtu_bus;
+
+
+/************************************************************************
+
+	struct rtu_txn
+
+	one request/reply. Fill in query (without checksum),
+	query_length, done and arg, then hand it to rtu_bus_submit().
+	done() is called from the loop with the same status the
+	blocking calls return: the reply length if OK, 0 on timeout or
+	CRC error, less than 0 for exceptions. The reply is in response
+	and when each phase of the transaction happened in times.
+
+	A transaction is owned by the loop from submit until done() is
+	called, after which it may be freed or submitted again.
+
+*************************************************************************/
+
+typedef void (*rtu_txn_done)( struct rtu_txn *txn, int status );
+
+struct rtu_txn {
+	unsigned char query[MAX_QUERY_LENGTH];
+	int query_length;
+	unsigned char response[MAX_RESPONSE_LENGTH];
+	int response_length;
+	long timeout;		/* uS to wait for the reply, 0 for 1 sec */
+	rtu_txn_done done;
+	void *arg;
+	struct modbus_txn_times times;	/* set by the loop */
+
+	/* kept by the loop */
+	int expected;		/* reply length, 0 if unknown */
+	struct rtu_txn *next;
+};
+
+
+
+/************************************************************************
+
+	struct rtu_bus / struct rtu_loop
+
+	treat as opaque; they live wherever the caller puts them.
+
+*************************************************************************/
+
+struct rtu_watch {
+	struct rtu_bus *bus;
+	int is_timer;
+};
+
+struct rtu_bus {
+	int fd;
+	int timer_fd;
+	struct rtu_loop *loop;
+	struct modbus_timing timing;
+	int state;
+	struct rtu_txn *cur;		/* on the wire */
+	struct rtu_txn *head, *tail;	/* waiting */
+	struct timespec idle_at;	/* end of the t3.5 gap */
+	long broadcast_delay;		/* uS, see set_broadcast_delay() */
+	struct modbus_port *port;	/* shared with the blocking calls */
+	int holding;			/* the port is ours */
+	struct rtu_watch rx_watch, timer_watch;
+};
+
+struct rtu_loop {
+	int epfd;
+	int pending;		/* transactions submitted, not yet done */
+};
+
+
+
+/************************************************************************
+
+	rtu_loop_init()	 / rtu_loop_close()
+
+	Returns:	0 if OK, PORT_FAILURE if epoll is not available
+
+*************************************************************************/
+
+int rtu_loop_init( struct rtu_loop *loop );
+
+void rtu_loop_close( struct rtu_loop *loop );
+
+
+
+/************************************************************************
+
+	rtu_bus_add()
+
+	adds a port opened by set_up_comms() to the loop. The port is
+	switched to non-blocking mode and its timing is taken from its
+	current settings.
+
+	The bus takes its turn in the port's queue (see modbus_port.h)
+	for every transaction, so the blocking calls can still be used
+	on the same fd from other threads; while one of them has the
+	port, the bus looks again every t3.5. Remove the bus before
+	closing the port.
+
+	Returns:	0 if OK, PORT_FAILURE otherwise
+
+*************************************************************************/
+
+int rtu_bus_add( struct rtu_loop *loop, struct rtu_bus *bus, int fd );
+
+void rtu_bus_remove( struct rtu_bus *bus );
+
+
+
+/************************************************************************
+
+	rtu_bus_submit()
+
+	queues a transaction on a bus. It goes on the wire as soon as
+	the transactions before it are done and the t3.5 gap is over.
+
+*************************************************************************/
+
+void rtu_bus_submit( struct rtu_bus *bus, struct rtu_txn *txn );
+
+
+
+/************************************************************************
+
+	rtu_loop_dispatch()
+
+	waits up to timeout_ms (-1 for ever) for something to happen on
+	any bus and handles it, calling done() of finished transactions.
+
+	rtu_loop_run() dispatches until no transaction is pending.
+
+	Returns:	the number of transactions still pending
+			PORT_FAILURE if epoll_wait() fails
+
+*************************************************************************/
+
+int rtu_loop_dispatch( struct rtu_loop *loop, int timeout_ms );
+
+int rtu_loop_run( struct rtu_loop *loop );
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MODBUS_LOOP_H */
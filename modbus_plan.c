@@ -0,0 +1,208 @@
+/* modbus_plan.c
+
+   Read coalescing for the RTU master.
+
+   The points are put into one list sorted by slave, table and start
+   address. Walking that list, a point joins the current request if it
+   is for the same slave and table, starts no more than max_gap
+   addresses past its end and the request stays within the limit of
+   one read; otherwise it starts a new request. On sorted ranges this
+   greedy pass gives the fewest requests.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include "modbus_rtu.h"
+#include "modbus_plan.h"
+
+
+/* most elements one request of this function may read */
+static int read_limit(int function)
+{
+	if (function == 0x01 || function == 0x02)
+		return (MAX_PDU_READ_BITS);
+	return (MAX_PDU_READ_REGS);
+}
+
+/* sort order of the points: slave, table, start address */
+static int point_before(struct read_point *a, struct read_point *b)
+{
+	if (a->slave != b->slave)
+		return (a->slave < b->slave);
+	if (a->function != b->function)
+		return (a->function < b->function);
+	return (a->start_addr < b->start_addr);
+}
+
+
+
+
+/************************************************************************
+
+	plan_reads
+
+	sorts the points and merges them into requests.
+
+*************************************************************************/
+
+int plan_reads(struct read_point *points, int n_points, int max_gap,
+	       struct read_request *requests, int max_requests)
+{
+	struct read_point *sorted = NULL, **link, *p, *next;
+	struct read_request *req = NULL;
+	int i, n = 0, end, limit;
+
+	if (max_gap < 0)
+		max_gap = 0;
+
+	/* insertion sort into one list; plans are made once and */
+	/* have tens of points, not thousands                   */
+	for (i = 0; i < n_points; i++) {
+		p = &points[i];
+		if (p->function < 0x01 || p->function > 0x04)
+			return (ILLEGAL_FUNCTION);
+		if (p->count > read_limit(p->function))
+			p->count = read_limit(p->function);
+		p->status = COMMS_FAILURE;
+
+		link = &sorted;
+		while (*link && !point_before(p, *link))
+			link = &(*link)->next;
+		p->next = *link;
+		*link = p;
+	}
+
+	for (p = sorted; p; p = next) {
+		next = p->next;
+		p->next = NULL;
+		if (p->count < 1)
+			continue;
+
+		limit = read_limit(p->function);
+		end = p->start_addr + p->count;	/* one past the last */
+
+		if (req && req->slave == p->slave
+		    && req->function == p->function
+		    && p->start_addr <= req->start_addr + req->count + max_gap
+		    && end - req->start_addr <= limit) {
+			if (end > req->start_addr + req->count)
+				req->count = end - req->start_addr;
+		} else {
+			if (n >= max_requests)
+				return (-1);
+			req = &requests[n++];
+			req->slave = p->slave;
+			req->function = p->function;
+			req->start_addr = p->start_addr;
+			req->count = p->count;
+			req->first = NULL;
+			req->n_points = 0;
+		}
+
+		/* kept in address order behind the request */
+		link = &req->first;
+		while (*link)
+			link = &(*link)->next;
+		*link = p;
+		req->n_points++;
+	}
+
+	return (n);
+}
+
+
+
+
+/************************************************************************
+
+	plan_scatter
+
+	copies the values of one request to its points.
+
+*************************************************************************/
+
+void plan_scatter(struct read_request *request, int *values, int n_values,
+		  int status)
+{
+	struct read_point *p;
+	int i, n, offset;
+
+	for (p = request->first; p; p = p->next) {
+		p->status = status;
+		if (status <= 0)
+			continue;
+
+		/* a short reply with a good CRC does not cover it */
+		offset = p->start_addr - request->start_addr;
+		if (offset + p->count > n_values) {
+			p->status = COMMS_FAILURE;
+			continue;
+		}
+
+		n = p->count < p->dest_size ? p->count : p->dest_size;
+		for (i = 0; i < n; i++)
+			p->dest[i] = values[offset + i];
+	}
+}
+
+
+
+
+/************************************************************************
+
+	plan_execute
+
+	runs the requests with the blocking calls.
+
+*************************************************************************/
+
+/* the elements in a reply: the blocking reads return 3 + the byte */
+/* count, and the bit reads the checksum as well                    */
+static int decoded_count(int function, int status)
+{
+	if (status <= 0)
+		return (0);
+	if (function == 0x01 || function == 0x02)
+		return ((status - 3 - 2) * 8);
+	return ((status - 3) / 2);
+}
+
+int plan_execute(struct read_request *requests, int n_requests, int fd)
+{
+	int values[MAX_PDU_READ_BITS];
+	struct read_request *req;
+	int i, status, failed = 0;
+
+	for (i = 0; i < n_requests; i++) {
+		req = &requests[i];
+		if (req->function == 0x01 || req->function == 0x02)
+			status = read_IO_status(req->function, req->slave,
+						req->start_addr, req->count,
+						values, req->count, fd);
+		else
+			status = read_registers(req->function, req->slave,
+						req->start_addr, req->count,
+						values, req->count, fd);
+
+		plan_scatter(req, values, decoded_count(req->function, status),
+			     status);
+		if (status <= 0 || decoded_count(req->function, status)
+		    < req->count)
+			failed++;
+	}
+
+	return (failed);
+}
@@ -0,0 +1,144 @@
+/* 		modbus_plan.h
+
+   Read coalescing for the RTU master.
+
+   A list of small reads, possibly scattered over several slaves and
+   tables, is merged into the fewest requests the protocol allows.
+   Ranges of the same slave and table that overlap, touch or are no
+   more than max_gap addresses apart go out as one read of up to 125
+   registers (2000 coils or inputs), and the result is copied back to
+   the destination of each of the original reads.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_PLAN_H
+#define MODBUS_PLAN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/************************************************************************
+
+	struct read_point
+
+	one read the application wants: function 0x01 to 0x04, the
+	result goes into dest exactly as read_coil_status() and friends
+	would put it there. count is clamped to the limit of one
+	request.
+
+	status is set by plan_execute() to the return value of the
+	request that covered the point, or to COMMS_FAILURE if the
+	reply was too short to cover it. next is kept by the planner.
+
+*************************************************************************/
+
+struct read_point {
+	int slave;
+	int function;
+	int start_addr;
+	int count;
+	int *dest;
+	int dest_size;
+
+	int status;
+	struct read_point *next;	/* same request, in address order */
+};
+
+
+
+/************************************************************************
+
+	struct read_request
+
+	one request on the wire and the points it covers.
+
+*************************************************************************/
+
+struct read_request {
+	int slave;
+	int function;
+	int start_addr;
+	int count;
+	struct read_point *first;
+	int n_points;
+};
+
+
+
+/************************************************************************
+
+	plan_reads()
+
+	merges the points into requests. max_gap is the number of
+	unwanted addresses a request may read to bridge two ranges;
+	0 merges only ranges that overlap or touch. Keep it small on
+	slaves that reject reads of addresses they do not have.
+
+	The points must not move or change until the plan is no
+	longer used.
+
+	Returns:	the number of requests
+			-1 if max_requests is too small
+			ILLEGAL_FUNCTION if a point is not a read
+
+*************************************************************************/
+
+int plan_reads( struct read_point *points, int n_points, int max_gap,
+		struct read_request *requests, int max_requests );
+
+
+
+/************************************************************************
+
+	plan_execute()
+
+	runs the requests of a plan on a port, one after the other,
+	and fills in the destination and status of every point.
+
+	Returns:	the number of requests that failed
+
+*************************************************************************/
+
+int plan_execute( struct read_request *requests, int n_requests, int fd );
+
+
+
+/************************************************************************
+
+	plan_scatter()
+
+	copies the result of one request, decoded into values (one
+	element per register or bit from start_addr on, n_values of
+	them, as decode_registers() or decode_bits() return), to its
+	points and sets their status. A point past n_values gets
+	COMMS_FAILURE and its dest is left alone. For code that runs
+	the requests itself, e.g. on an rtu_loop.
+
+*************************************************************************/
+
+void plan_scatter( struct read_request *request, int *values, int n_values,
+		   int status );
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MODBUS_PLAN_H */
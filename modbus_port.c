@@ -0,0 +1,228 @@
+/* modbus_port.c
+
+   Port contexts and the first come first served bus queue.
+
+   The queue is a ticket lock: a thread takes the next ticket and
+   sleeps on the port's condition until the ticket being served is
+   its own. The mutex is only held to take or hand on a ticket, never
+   while the frames are on the wire.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "modbus_port.h"
+
+static struct modbus_port **ports;	/* by fd */
+static int n_slots;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+
+/* the slot of fd in the table, which grows to take it if grow is  */
+/* set; NULL if there is none. Call with table_lock held.         */
+static struct modbus_port **slot_of(int fd, int grow)
+{
+	struct modbus_port **bigger;
+	int n;
+
+	if (fd < 0)
+		return (NULL);
+	if (fd >= n_slots) {
+		if (!grow)
+			return (NULL);
+		n = n_slots ? n_slots : PORT_TABLE_SIZE;
+		while (n <= fd)
+			n *= 2;
+		bigger = realloc(ports, n * sizeof(*ports));
+		if (!bigger)
+			return (NULL);
+		memset(bigger + n_slots, 0, (n - n_slots) * sizeof(*ports));
+		ports = bigger;
+		n_slots = n;
+	}
+	return (&ports[fd]);
+}
+
+static struct modbus_port *new_port(void)
+{
+	struct modbus_port *port = calloc(1, sizeof(*port));
+
+	if (!port)
+		return (NULL);
+	pthread_mutex_init(&port->lock, NULL);
+	pthread_cond_init(&port->turn, NULL);
+	port->broadcast_delay = BROADCAST_DELAY;
+	return (port);
+}
+
+
+
+
+/*************************************************************************
+
+	port_open / port_of / port_close
+
+**************************************************************************/
+
+struct modbus_port *port_open(int fd, int baud, const char *parity)
+{
+	struct modbus_port **slot, *port;
+	int char_bits;
+
+	pthread_mutex_lock(&table_lock);
+	slot = slot_of(fd, 1);
+	port = NULL;
+	if (slot) {
+		if (!*slot)
+			*slot = new_port();
+		port = *slot;
+	}
+	pthread_mutex_unlock(&table_lock);
+	if (!port)
+		return (NULL);
+
+	/* start + 8 data bits + parity + stop bit */
+	char_bits = strncmp(parity, "none", 4) ? 11 : 10;
+
+	pthread_mutex_lock(&port->lock);
+	port->fd = fd;
+	port->baud = baud;
+	strncpy(port->parity, parity, sizeof(port->parity) - 1);
+	compute_char_timing(baud, char_bits, &port->timing);
+	memset(&port->counters, 0, sizeof(port->counters));
+	clock_gettime(CLOCK_MONOTONIC, &port->idle_at);
+	pthread_mutex_unlock(&port->lock);
+
+	return (port);
+}
+
+struct modbus_port *port_of(int fd)
+{
+	struct modbus_port **slot, *port;
+
+	pthread_mutex_lock(&table_lock);
+	slot = slot_of(fd, 1);
+	port = slot ? *slot : NULL;
+	if (slot && !port && (port = *slot = new_port())) {
+		/* a port opened by the caller; go by its settings */
+		port->fd = fd;
+		if (get_line_timing(fd, &port->timing) < 0)
+			compute_char_timing(9600, 10, &port->timing);
+		port->baud = 0;
+		strcpy(port->parity, "?");
+		clock_gettime(CLOCK_MONOTONIC, &port->idle_at);
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	return (port);
+}
+
+void port_close(int fd)
+{
+	struct modbus_port **slot, *port = NULL;
+
+	pthread_mutex_lock(&table_lock);
+	slot = slot_of(fd, 0);
+	if (slot) {
+		port = *slot;
+		*slot = NULL;
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	if (port) {
+		pthread_mutex_destroy(&port->lock);
+		pthread_cond_destroy(&port->turn);
+		free(port);
+	}
+}
+
+
+
+
+/*************************************************************************
+
+	port_acquire / port_release
+
+**************************************************************************/
+
+void port_acquire(struct modbus_port *port)
+{
+	unsigned long ticket;
+
+	pthread_mutex_lock(&port->lock);
+	ticket = port->next_ticket++;
+	while (port->serving != ticket)
+		pthread_cond_wait(&port->turn, &port->lock);
+	pthread_mutex_unlock(&port->lock);
+}
+
+int port_try_acquire(struct modbus_port *port)
+{
+	int got = 0;
+
+	pthread_mutex_lock(&port->lock);
+	if (port->serving == port->next_ticket) {
+		port->next_ticket++;
+		got = 1;
+	}
+	pthread_mutex_unlock(&port->lock);
+	return (got);
+}
+
+void port_release(struct modbus_port *port, int status, int rx_bytes)
+{
+	pthread_mutex_lock(&port->lock);
+	stats_count(&port->counters, status, rx_bytes);
+	port->serving++;
+	pthread_cond_broadcast(&port->turn);
+	pthread_mutex_unlock(&port->lock);
+}
+
+
+
+
+/*************************************************************************
+
+	port_info
+
+**************************************************************************/
+
+int port_info(int fd, struct modbus_port *out)
+{
+	struct modbus_port **slot, *port;
+
+	pthread_mutex_lock(&table_lock);
+	slot = slot_of(fd, 0);
+	port = slot ? *slot : NULL;
+	pthread_mutex_unlock(&table_lock);
+	if (!port)
+		return (PORT_FAILURE);
+
+	memset(out, 0, sizeof(*out));
+	pthread_mutex_lock(&port->lock);
+	out->fd = port->fd;
+	out->baud = port->baud;
+	memcpy(out->parity, port->parity, sizeof(out->parity));
+	out->timing = port->timing;
+	out->broadcast_delay = port->broadcast_delay;
+	out->counters = port->counters;
+	pthread_mutex_unlock(&port->lock);
+
+	return (0);
+}
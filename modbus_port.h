@@ -0,0 +1,149 @@
+/* 		modbus_port.h
+
+   What the master keeps per serial port.
+
+   Every call of the library names its port by the fd set_up_comms()
+   returned, and the fd leads to a struct modbus_port holding that
+   line's timing, its t3.5 gap, the transaction on the wire and its
+   counters. Ports at different speeds in one process no longer share
+   any of it.
+
+   A port is also a queue. A transaction takes the port when its
+   query goes out and gives it back when the reply is in or has timed
+   out; the threads waiting get it in the order they asked, one
+   transaction each, so any number of threads can share one RS485
+   segment without their frames meeting on the wire.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_PORT_H
+#define MODBUS_PORT_H
+
+#include <pthread.h>
+#include <time.h>
+#include "modbus_rtu.h"
+#include "modbus_stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define PORT_TABLE_SIZE 64	/* first size of the table of ports by */
+				/* fd; it doubles to take higher fds   */
+
+
+
+/************************************************************************
+
+	struct modbus_port
+
+	the first fields may be read through port_info(); the rest
+	belong to the master code.
+
+*************************************************************************/
+
+struct modbus_port {
+	int fd;
+	int baud;
+	char parity[8];
+	struct modbus_timing timing;
+	struct modbus_counters counters;
+	long broadcast_delay;		/* uS, see set_broadcast_delay() */
+
+	/* kept by the master code */
+	struct timespec idle_at;	/* end of the t3.5 gap */
+	struct modbus_txn_times times;	/* of the transaction on the wire */
+	pthread_mutex_t lock;
+	pthread_cond_t turn;
+	unsigned long next_ticket;	/* handed to the next one to ask */
+	unsigned long serving;		/* the ticket that has the port */
+};
+
+
+
+/************************************************************************
+
+	port_open()	port_of()	port_close()
+
+	port_open() (re)starts the port of an fd for a line set up at
+	baud and parity; set_up_comms() calls it. port_of() finds the
+	port of an fd, setting one up from the fd's current settings
+	for an fd the library has not seen before.
+
+	Returns:	the port, NULL if fd is negative or out of memory
+
+	port_close() forgets the port of fd, so that a line opened
+	later on the same fd number starts afresh; call it before
+	closing a port the library has used, with no transaction on
+	it running.
+
+*************************************************************************/
+
+struct modbus_port *port_open( int fd, int baud, const char *parity );
+
+struct modbus_port *port_of( int fd );
+
+void port_close( int fd );
+
+
+
+/************************************************************************
+
+	port_acquire()	port_try_acquire()	port_release()
+
+	port_acquire() waits for the port, first come first served.
+	port_try_acquire() takes it only if it is free and nobody is
+	waiting, and never waits; it returns 1 if it got the port. An
+	rtu_loop uses it, so as not to block the loop. port_release()
+	counts the transaction's outcome (status and rx_bytes as for
+	stats_record()) and hands the port on.
+
+	send_query() acquires and modbus_response() releases; a caller
+	of send_query() must call modbus_response() next, unless
+	send_query() failed.
+
+*************************************************************************/
+
+void port_acquire( struct modbus_port *port );
+
+int port_try_acquire( struct modbus_port *port );
+
+void port_release( struct modbus_port *port, int status, int rx_bytes );
+
+
+
+/************************************************************************
+
+	port_info()
+
+	copies out the public fields of the port of fd: its settings,
+	timing and counters.
+
+	Returns:	0 if OK, PORT_FAILURE if fd has no port
+
+*************************************************************************/
+
+int port_info( int fd, struct modbus_port *out );
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MODBUS_PORT_H */
@@ -31,18 +31,140 @@
 #include <sys/time.h>		/* Time structures for select() */
 #include <unistd.h>		/* POSIX Symbolic Constants */
 #include <errno.h>		/* Error definitions */
+#include <time.h>		/* clock_gettime() for the inter-frame gap */
 #include "modbus_rtu.h"
-
-#define DEBUG                /* uncomment to see the data sent and received */
+#include "modbus_crc.h"
+#include "modbus_be16.h"
+#include "modbus_bits.h"
+#include "modbus_stats.h"
+#include "modbus_trace.h"
+#include "modbus_port.h"
+
+// #define DEBUG             /* uncomment for messages on stderr; frames are */
+				/* traced with MODBUS_TRACE, see modbus_trace.h */
 // #define DEBUG_CHITO  /* mas comentarios para encontrar el error en recepcion */
 
-int char_interval_timeout;
+/* the timing of a line, its t3.5 gap and the transaction on the */
+/* wire are kept per port, see modbus_port.h                      */
+
 
 enum {
 FALSE = 0,
 TRUE
 };
 
+#define REQUEST_QUERY_SIZE 6	/* the following packets require          */
+#define CHECKSUM_SIZE 2		/* 6 unsigned chars for the packet plus   */
+				/* 2 for the checksum.                    */
+#define MIN_RESPONSE_LENGTH 4	/* address, function code and checksum */
+
+
+
+
+/*************************************************************************
+
+   compute_char_timing( baud, char_bits, timing )
+
+Works out the character time and the t1.5 / t3.5 silent intervals of
+the Modbus serial line spec. char_bits counts start, data, parity and
+stop bits, 11 for 8E1. Above 19200 bps the spec fixes the intervals at
+750 uS and 1750 uS.
+**************************************************************************/
+
+void compute_char_timing(int baud, int char_bits, struct modbus_timing *t)
+{
+	if (baud <= 0)
+		baud = 9600;
+
+	t->char_ns = (char_bits * 1000000000L + baud - 1) / baud;
+
+	if (baud > 19200) {
+		t->t15 = T15_FLOOR;
+		t->t35 = T35_FLOOR;
+	} else {
+		t->t15 = (t->char_ns * 3 / 2 + 999) / 1000;
+		t->t35 = (t->char_ns * 7 / 2 + 999) / 1000;
+	}
+}
+
+
+
+
+/*************************************************************************
+
+   get_line_timing( file_descriptor, timing )
+
+Same as compute_char_timing() but for the speed and character format a
+port is set up with right now.
+
+Returns:	0 if OK, PORT_FAILURE if the settings cannot be read
+**************************************************************************/
+
+int get_line_timing(int ttyfd, struct modbus_timing *t)
+{
+	static const struct {
+		speed_t code;
+		int baud;
+	} speeds[] = {
+		{ B110, 110 }, { B300, 300 }, { B600, 600 },
+		{ B1200, 1200 }, { B2400, 2400 }, { B4800, 4800 },
+		{ B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 },
+		{ B57600, 57600 }, { B115200, 115200 },
+		{ B230400, 230400 }, { B460800, 460800 },
+		{ B921600, 921600 },
+	};
+	struct termios settings;
+	speed_t code;
+	int i, baud = 9600, char_bits;
+
+	if (tcgetattr(ttyfd, &settings) < 0)
+		return (PORT_FAILURE);
+
+	code = cfgetospeed(&settings);
+	for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++) {
+		if (speeds[i].code == code)
+			baud = speeds[i].baud;
+	}
+
+	char_bits = 1 + 8 + ((settings.c_cflag & PARENB) ? 1 : 0)
+	    + ((settings.c_cflag & CSTOPB) ? 2 : 1);
+	compute_char_timing(baud, char_bits, t);
+
+	return (0);
+}
+
+
+
+
+/* now + ns */
+static void time_after(struct timespec *ts, long ns)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_nsec += ns;
+	while (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+}
+
+
+
+
+/*************************************************************************
+
+   wait_frame_gap( port )
+
+Sleeps until the t3.5 silence after the last frame seen on the bus has
+passed, so that back to back queries go out as early as the spec allows
+and callers do not need sleep()s of their own.
+**************************************************************************/
+
+static void wait_frame_gap(struct modbus_port *port)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			       &port->idle_at, NULL) == EINTR);
+}
+
 /*************************************************************************
 
    modbus_query( packet, length)
@@ -56,11 +178,6 @@ void modbus_query(unsigned char *packet, size_t string_length)
 {
 	int temp_crc;
 
-	/* declaration */
-	unsigned int crc(unsigned char buf[], int start, int cnt);
-
-
-
 	temp_crc = crc(packet, 0, string_length);
 
 	packet[string_length++] = temp_crc >> 8;
@@ -71,35 +188,51 @@ void modbus_query(unsigned char *packet, size_t string_length)
 
 
 
+/***********************************************************************
+
+   set_broadcast_delay( file_descriptor, usec )
+
+************************************************************************/
+
+void set_broadcast_delay(int fd, long usec)
+{
+	struct modbus_port *port = port_of(fd);
+
+	if (!port)
+		return;
+	pthread_mutex_lock(&port->lock);
+	port->broadcast_delay = usec;
+	pthread_mutex_unlock(&port->lock);
+}
+
+
+
+
 /***********************************************************************
 
    send_query( file_descriptor, query_string, query_length )
 
 Function to send a query out to a modbus slave.
+The port is held from here until modbus_response() has the reply, so
+other threads wait their turn; on failure it is let go at once.
 ************************************************************************/
 
 int send_query(int ttyfd, unsigned char *query, size_t string_length)
 {
+	struct modbus_port *port = port_of(ttyfd);
 	int write_stat;
+	long gap;
 
 	int status;
-#ifdef DEBUG
-	int i;
-#endif
+
+	if (!port)
+		return (PORT_FAILURE);
 
 	modbus_query(query, string_length);
 	string_length += 2;
 
-#ifdef DEBUG
-// Print to stderr the hex value of each character that is about to be
-// sent to the modbus slave.
-
-	for (i = 0; i < string_length; i++) {
-		fprintf(stderr, "[%0.2X]", query[i]);
-	}
-	fprintf(stderr, " - string length = %d", string_length);
-	fprintf(stderr, "\n");
-#endif
+	port_acquire(port);
+	wait_frame_gap(port);
 
 	tcflush(ttyfd, TCIOFLUSH);	/* flush the input & output streams */
 
@@ -107,77 +240,172 @@ int send_query(int ttyfd, unsigned char *query, size_t string_length)
 	ioctl(ttyfd, TIOCMGET, &status);
 	status |= TIOCM_RTS;
 	ioctl(ttyfd, TIOCMSET, &status);
+	memset(&port->times, 0, sizeof(port->times));
+	port->times.tx_start = stats_now();
 	write_stat = write(ttyfd, query, string_length);
+	port->times.tx_end = stats_now();
+	trace_frame(TRACE_TX, ttyfd, query, string_length);
+
+	/* the query is still on the wire for string_length characters;
+	   after a broadcast the slaves get their turnaround delay too */
+	gap = port->timing.t35 * 1000L;
+	if (query[0] == BROADCAST_ADDRESS && gap < port->broadcast_delay * 1000L)
+		gap = port->broadcast_delay * 1000L;
+	time_after(&port->idle_at, string_length * port->timing.char_ns + gap);
 	tcflush(ttyfd, TCIFLUSH);	/* maybe not neccesary */
 
+	if (write_stat < 0) {
+		port->times.done = port->times.tx_end;
+		stats_record(query, &port->times, PORT_FAILURE, 0);
+		port_release(port, PORT_FAILURE, 0);
+	}
+
 	return (write_stat);
 }
 
 
 /*********************************************************************
 
-	modbus_response( response_data_array, query_array )
+	expected_response_length( query_array )
+
+   Works out from the query how long the reply will be, so that
+   receive_response() can stop as soon as the last byte is in instead
+   of waiting for the line to go quiet.
+
+   Returns:	the length of a normal reply, checksum included
+		0 if the function code is not known
+**********************************************************************/
+
+int expected_response_length(unsigned char *query)
+{
+	int count = (query[4] << 8) | query[5];
+
+	switch (query[1]) {
+	case 0x01:
+	case 0x02:
+		return (3 + (count + 7) / 8 + CHECKSUM_SIZE);
+	case 0x03:
+	case 0x04:
+	case 0x17:
+		return (3 + count * 2 + CHECKSUM_SIZE);
+	case 0x05:
+	case 0x06:
+	case 0x0F:
+	case 0x10:
+		return (6 + CHECKSUM_SIZE);
+	}
+	return (0);
+}
 
-   Function to the correct response is returned and that the checksum
-   is correct.
 
-   Returns:	string_length if OK
-		0 if failed
-		Less than 0 for exception errors
 
-	Note: All functions used for sending or receiving data via
-	      modbus return these return values.
 
+/*********************************************************************
+
+	broadcast_status( query_array )
+
+   No slave answers a broadcast, so a write is taken as done once it
+   is sent; a broadcast read can only fail.
+
+   Returns:	the length of the reply to a write, checksum included
+		COMMS_FAILURE for other function codes
 **********************************************************************/
 
-int modbus_response(unsigned char *data, unsigned char *query, int fd)
+int broadcast_status(unsigned char *query)
 {
-	int response_length;
+	switch (query[1]) {
+	case 0x05:
+	case 0x06:
+	case 0x0F:
+	case 0x10:
+		return (expected_response_length(query));
+	}
+	return (COMMS_FAILURE);
+}
 
-	unsigned short crc_calc = 0;
-	unsigned short crc_received = 0;
-	unsigned char recv_crc_hi;
-	unsigned char recv_crc_lo;
 
 
-	/* local declaration */
-	int receive_response(unsigned char *received_string, int ttyfd);
-	unsigned int crc(unsigned char buf[], int start, int cnt);
 
+/*********************************************************************
 
-	response_length = receive_response(data, fd);
-	if (response_length) {
-		crc_calc = crc(data, 0, response_length - 2);
+	frame_length( received_data, bytes_received, expected_length )
 
-		recv_crc_hi = (unsigned) data[response_length - 2];
-		recv_crc_lo = (unsigned) data[response_length - 1];
+   Refines the expected reply length once its header is in: an
+   exception reply is always 5 bytes long and a read reply carries
+   its own byte count. A byte count too large for a reply (a bad
+   byte on the line) gives MAX_RESPONSE_LENGTH, which the receivers
+   take as a failed frame.
 
-		crc_received = data[response_length - 2];
-		crc_received = (unsigned) crc_received << 8;
-		crc_received =
-		    crc_received | (unsigned) data[response_length - 1];
+   Returns:	the new expected length, 0 if still unknown
+**********************************************************************/
 
+int frame_length(unsigned char *data, int bytes_received, int expected)
+{
+	if (bytes_received >= 2 && (data[1] & 0x80))
+		return (3 + CHECKSUM_SIZE);
+
+	if (expected && bytes_received >= 3
+	    && ((data[1] >= 0x01 && data[1] <= 0x04) || data[1] == 0x17)) {
+		if (3 + data[2] + CHECKSUM_SIZE > MAX_RESPONSE_LENGTH)
+			return (MAX_RESPONSE_LENGTH);
+		return (3 + data[2] + CHECKSUM_SIZE);
+	}
 
-		/*********** check CRC of response ************/
+	return (expected);
+}
 
-		if (crc_calc != crc_received) {
 
-			fprintf(stderr, "crc error received ");
-			fprintf(stderr, "%0X - ", crc_received);
-			fprintf(stderr, "crc_calc %0X\n", crc_calc);
 
-			response_length = 0;
 
-		}
+/*********************************************************************
 
+	check_response( response_data_array, length, query_array )
 
+   Checks the CRC of a complete reply and whether it is an exception.
 
-		/********** check for exception response *****/
+   Returns:	length if OK
+		0 if the CRC is wrong, or the reply is shorter than the
+		4 bytes of address, function code and CRC
+		Less than 0 for exception errors
+**********************************************************************/
 
-		if (response_length && data[1] != query[1]) {
-			response_length = 0 - data[2];
-		}
+int check_response(unsigned char *data, int response_length,
+		   unsigned char *query)
+{
+	unsigned short crc_calc = 0;
+	unsigned short crc_received = 0;
+
+	if (response_length < 1)
+		return (response_length);
+	if (response_length < MIN_RESPONSE_LENGTH)
+		return (0);	/* the slave stopped after a byte or two */
+
+	crc_calc = crc(data, 0, response_length - 2);
+
+	crc_received = data[response_length - 2];
+	crc_received = (unsigned) crc_received << 8;
+	crc_received = crc_received | (unsigned) data[response_length - 1];
+
+
+	/*********** check CRC of response ************/
+
+	if (crc_calc != crc_received) {
+#ifdef DEBUG
+		fprintf(stderr, "crc error received ");
+		fprintf(stderr, "%0X - ", crc_received);
+		fprintf(stderr, "crc_calc %0X\n", crc_calc);
+#endif
+		return (0);
 	}
+
+
+
+	/********** check for exception response *****/
+
+	if (data[1] != query[1]) {
+		response_length = 0 - data[2];
+	}
+
 	/* FIXME: it does not check for the slave id; jpz */
 	return (response_length);
 }
@@ -185,27 +413,86 @@ int modbus_response(unsigned char *data, unsigned char *query, int fd)
 
 
 
+/*********************************************************************
+
+	modbus_response( response_data_array, query_array )
+
+   Function to the correct response is returned and that the checksum
+   is correct.
+
+   Returns:	string_length if OK
+		0 if failed
+		Less than 0 for exception errors
+
+	Note: All functions used for sending or receiving data via
+	      modbus return these return values.
+
+**********************************************************************/
+
+int modbus_response(unsigned char *data, unsigned char *query, int fd)
+{
+	struct modbus_port *port = port_of(fd);
+	int response_length;
+	int status;
+
+	/* local declaration */
+	int receive_response(unsigned char *received_string, int ttyfd,
+			     int expected);
+
+
+	if (query[0] == BROADCAST_ADDRESS) {
+		/* nobody answers; a write counts as done once it is sent */
+		port->times.done = stats_now();
+		status = broadcast_status(query);
+		stats_record(query, &port->times, status, 0);
+		port_release(port, status, 0);
+		return (status);
+	}
+
+	response_length = receive_response(data, fd,
+					   expected_response_length(query));
+
+	status = check_response(data, response_length, query);
+	stats_record(query, &port->times, status,
+		     response_length > 0 ? response_length : 0);
+	port_release(port, status, response_length > 0 ? response_length : 0);
+
+	return (status);
+}
+
+
+
+
 
 
 
 
 /***********************************************************************
 
-	receive_response( array_for_data )
+	receive_response( array_for_data, file_descriptor, expected_length )
 
    Function to monitor for the reply from the modbus slave.
    This function blocks for timeout seconds if there is no reply.
 
+   The reply is read in as large pieces as the driver hands over.
+   The frame is complete as soon as expected_length bytes are in;
+   the byte count of a read reply and the 5 byte length of an
+   exception reply override the guess once their header arrives.
+   With expected_length 0 the end of the frame is only found by
+   waiting t3.5 for the line to go quiet.
+
    Returns:	Total number of characters received.
 ***********************************************************************/
 
-int receive_response(unsigned char *received_string, int ttyfd)
+int receive_response(unsigned char *received_string, int ttyfd,
+		     int expected)
 {
-
-	int rxchar = PORT_FAILURE;
-	int data_avail = FALSE;
+	struct modbus_port *port = port_of(ttyfd);
 	int bytes_received = 0;
 	int read_stat;
+	int wanted;
+	int ready;
+	long usec;
 
 	int timeout = 1;	/* 1 second */
 
@@ -213,87 +500,235 @@ int receive_response(unsigned char *received_string, int ttyfd)
 
 	struct timeval tv;
 
-	tv.tv_sec = timeout;
-	tv.tv_usec = 0;
+#ifdef DEBUG
+	fprintf(stderr, "Waiting for response.\n");
+#endif
 
-	FD_ZERO(&rfds);
-	FD_SET(ttyfd, &rfds);
+	if (expected > MAX_RESPONSE_LENGTH)
+		expected = 0;
+
+	while (bytes_received < MAX_RESPONSE_LENGTH) {
+		/* wait for the first character for up to timeout   */
+		/* seconds. After that, when the length is known,    */
+		/* allow the wire time of the missing bytes; when it */
+		/* is not, a silence of t3.5 ends the frame          */
+		if (bytes_received == 0) {
+			tv.tv_sec = timeout;
+			tv.tv_usec = 0;
+		} else if (expected) {
+			usec = (expected - bytes_received)
+			    * port->timing.char_ns / 1000
+			    + port->timing.t35 + RX_LATENCY_SLACK;
+			tv.tv_sec = usec / 1000000;
+			tv.tv_usec = usec % 1000000;
+		} else {
+			tv.tv_sec = 0;
+			tv.tv_usec = port->timing.t35;
+		}
 
+		FD_ZERO(&rfds);
+		FD_SET(ttyfd, &rfds);
 
+		ready = select(ttyfd + 1, &rfds, NULL, NULL, &tv);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			port->times.done = stats_now();
+			return (PORT_FAILURE);
+		}
+		if (ready == 0) {
+			if (bytes_received == 0)
+				fprintf(stderr, "Comms time out\n");
+			break;
+		}
 
+		wanted = (expected ? expected : MAX_RESPONSE_LENGTH)
+		    - bytes_received;
+		if (wanted > MAX_RESPONSE_LENGTH - bytes_received)
+			wanted = MAX_RESPONSE_LENGTH - bytes_received;
+		read_stat = read(ttyfd, received_string + bytes_received,
+				 wanted);
+		if (read_stat < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			port->times.done = stats_now();
+			return (PORT_FAILURE);
+		}
+		if (read_stat > 0) {
+			port->times.rx_last = stats_now();
+			if (!bytes_received)
+				port->times.rx_first = port->times.rx_last;
+		}
 
-#ifdef DEBUG
-	fprintf(stderr, "Waiting for response.\n");
-#endif
+		bytes_received += read_stat;
 
-	/* wait for a response */
-	data_avail = select(FD_SETSIZE, &rfds, NULL, NULL, &tv);
+		expected = frame_length(received_string, bytes_received,
+					expected);
 
-	if (!data_avail) {
-		bytes_received = 0;
-		fprintf(stderr, "Comms time out\n");
+		if (expected && bytes_received >= expected)
+			break;
 	}
 
+	/* the bus is free t3.5 after the last character */
+	time_after(&port->idle_at, port->timing.t35 * 1000L);
+	port->times.done = stats_now();
 
-	tv.tv_sec = 0;
-	tv.tv_usec = char_interval_timeout;
+	if (bytes_received > 0)
+		trace_frame(TRACE_RX, ttyfd, received_string, bytes_received);
+	else
+		trace_frame(TRACE_TIMEOUT, ttyfd, NULL, 0);
 
-	FD_ZERO(&rfds);
-	FD_SET(ttyfd, &rfds);
+	if (bytes_received >= MAX_RESPONSE_LENGTH)
+		bytes_received = PORT_FAILURE;
+#ifdef DEBUG_CHITO
+	fprintf(stderr, "receive_response: bytes recibidos: %d\n",
+		bytes_received);
+#endif
 
-	while (data_avail) {
-		/* antes de leer un byte, hacer una pausa de "un byte", 
-		 * de lo contrario, otro proceso se apodera de la linea RTS */
-		//esperaRTS(1);
-		/* if no character at the buffer wait char_interval_timeout */
-		/* before accepting end of response                         */
+	return (bytes_received);
+}
 
-		if (select(FD_SETSIZE, &rfds, NULL, NULL, &tv)) {
 
 
-			read_stat = read(ttyfd, &rxchar, 1);
 
-			if (read_stat < 0) {
-				bytes_received = PORT_FAILURE;
-				data_avail = FALSE;
-			} else {
-				rxchar = rxchar & 0xFF;
-				received_string[bytes_received++] = rxchar;
-			}
 
 
-			if (bytes_received >= MAX_RESPONSE_LENGTH) {
-				bytes_received = PORT_FAILURE;
-				data_avail = FALSE;
-			}
-#ifdef DEBUG
-			/* display the hex code of each character received */
-			fprintf(stderr, "<%0.2X>", rxchar);
-#endif
 
+/**************************************************************************
+
+	decode_bits
+
+	sets dest[0 .. count - 1] to TRUE or FALSE from the bits of a
+	FC01/FC02 reply.
+
+	Returns:	the number of elements set
+
+**************************************************************************/
+
+int decode_bits(unsigned char *data, int length, int count,
+		int *dest, int dest_size)
+{
+	int i;
+
+	/* only the bits present in the reply */
+	if (count > data[2] * 8)
+		count = data[2] * 8;
+	if (count > (length - 3 - CHECKSUM_SIZE) * 8)
+		count = (length - 3 - CHECKSUM_SIZE) * 8;
+	if (count > dest_size)
+		count = dest_size;
+
+	for (i = 0; i < count; i++) {
+		if (data[3 + i / 8] & (1 << (i % 8))) {
+			dest[i] = TRUE;
 		} else {
-			data_avail = FALSE;
+			dest[i] = FALSE;
 		}
-
 	}
 
-#ifdef DEBUG
-	fprintf(stderr, "\n");
-#endif
-/* Al restar 2 a bytes_received, el crc de retorno es calculado a partir de 
- *	2 bytes menos, lo que resulta en crc_error en lectura. ¡ELIMINADO!
- */
-#if 0
-	if (bytes_received > 2) {
-		bytes_received -= 2;
+	return (i);
+}
+
+
+
+
+/**************************************************************************
+
+	decode_registers
+
+	puts the registers of a FC03/FC04 reply into dest.
+
+	Returns:	the number of registers decoded
+
+**************************************************************************/
+
+int decode_registers(unsigned char *data, int length,
+		     int *dest, int dest_size)
+{
+	int temp, i, count;
+
+	count = data[2] / 2;
+	if (count > (length - 3 - CHECKSUM_SIZE) / 2)
+		count = (length - 3 - CHECKSUM_SIZE) / 2;
+	if (count > dest_size)
+		count = dest_size;
+
+	for (i = 0; i < count; i++) {
+		/* shift reg hi_byte to temp */
+		temp = data[3 + i * 2] << 8;
+		/* OR with lo_byte           */
+		temp = temp | data[4 + i * 2];
+
+		dest[i] = temp;
 	}
-#endif
-#ifdef DEBUG_CHITO
-	fprintf(stderr, "receive_response: bytes recibidos: %d\n",
-		bytes_received);
-#endif
 
-	return (bytes_received);
+	return (i);
+}
+
+
+
+
+
+
+
+/**************************************************************************
+
+	decode_bits_packed
+
+	copies the bits of a FC01/FC02 reply to dest as they are, with
+	the bits past count cleared.
+
+	Returns:	the number of coils copied
+
+**************************************************************************/
+
+int decode_bits_packed(unsigned char *data, int length, int count,
+		       unsigned char *dest, int dest_bytes)
+{
+	if (count > data[2] * 8)
+		count = data[2] * 8;
+	if (count > (length - 3 - CHECKSUM_SIZE) * 8)
+		count = (length - 3 - CHECKSUM_SIZE) * 8;
+	if (count > dest_bytes * 8)
+		count = dest_bytes * 8;
+	if (count < 0)
+		count = 0;
+
+	memcpy(dest, data + 3, COIL_BYTES(count));
+	if (count & 7)
+		dest[count / 8] &= (1 << (count & 7)) - 1;
+
+	return (count);
+}
+
+
+
+
+/**************************************************************************
+
+	decode_registers16
+
+	same as decode_registers(), but into uint16_t straight from the
+	reply, with be16_decode().
+
+**************************************************************************/
+
+int decode_registers16(unsigned char *data, int length,
+		       uint16_t *dest, int dest_size)
+{
+	int count;
+
+	count = data[2] / 2;
+	if (count > (length - 3 - CHECKSUM_SIZE) / 2)
+		count = (length - 3 - CHECKSUM_SIZE) / 2;
+	if (count > dest_size)
+		count = dest_size;
+	if (count < 0)
+		count = 0;
+
+	be16_decode(dest, data + 3, count);
+
+	return (count);
 }
 
 
@@ -309,10 +744,6 @@ int receive_response(unsigned char *received_string, int ttyfd)
 
 ***********************************************************************/
 
-#define REQUEST_QUERY_SIZE 6	/* the following packets require          */
-#define CHECKSUM_SIZE 2		/* 6 unsigned chars for the packet plus   */
-				/* 2 for the checksum.                    */
-
 void build_request_packet(int slave, int function, int start_addr,
 			  int count, unsigned char *packet)
 {
@@ -415,6 +846,53 @@ int read_input_status(int slave, int start_addr, int count,
 
 
 
+/************************************************************************
+
+	read_coil_status_packed / read_input_status_packed
+
+	same as the calls without _packed, into packed bits.
+
+************************************************************************/
+
+static int read_IO_status_packed(int function, int slave, int start_addr,
+				 int count, unsigned char *dest,
+				 int dest_bytes, int ttyfd)
+{
+	unsigned char packet[REQUEST_QUERY_SIZE + CHECKSUM_SIZE];
+	unsigned char data[MAX_RESPONSE_LENGTH];
+	int status;
+
+	build_request_packet(slave, function, start_addr, count, packet);
+
+	if (send_query(ttyfd, packet, REQUEST_QUERY_SIZE) < 0)
+		return (PORT_FAILURE);
+
+	status = modbus_response(data, packet, ttyfd);
+	if (status > 0)
+		decode_bits_packed(data, status, count, dest, dest_bytes);
+
+	return (status);
+}
+
+
+int read_coil_status_packed(int slave, int start_addr, int count,
+			    unsigned char *dest, int dest_bytes, int ttyfd)
+{
+	return (read_IO_status_packed(0x01, slave, start_addr, count,
+				      dest, dest_bytes, ttyfd));
+}
+
+
+int read_input_status_packed(int slave, int start_addr, int count,
+			     unsigned char *dest, int dest_bytes, int ttyfd)
+{
+	return (read_IO_status_packed(0x02, slave, start_addr, count,
+				      dest, dest_bytes, ttyfd));
+}
+
+
+
+
 /**************************************************************************
 
 	read_IO_stat_response
@@ -430,29 +908,13 @@ int read_IO_stat_response(int *dest, int dest_size, int coil_count,
 
 	unsigned char data[MAX_RESPONSE_LENGTH];
 	int raw_response_length;
-	int temp, i, bit, dest_pos = 0;
-	int coils_processed = 0;
 
 	raw_response_length = modbus_response(data, query, fd);
 
 
-	if (raw_response_length > 0) {
-		for (i = 0; i < (data[2]) && i < dest_size; i++) {
-			/* shift reg hi_byte to temp */
-			temp = data[3 + i];
-			for (bit = 0x01; bit & 0xff &&
-			     coils_processed < coil_count;) {
-				if (temp & bit) {
-					dest[dest_pos] = TRUE;
-				} else {
-					dest[dest_pos] = FALSE;
-				}
-				coils_processed++;
-				dest_pos++;
-				bit = bit << 1;
-			}
-		}
-	}
+	if (raw_response_length > 0)
+		decode_bits(data, raw_response_length, coil_count,
+			    dest, dest_size);
 
 	return (raw_response_length);
 }
@@ -558,43 +1020,138 @@ int read_input_registers(int slave, int start_addr, int count,
 
 
 
-/************************************************************************
+/************************************************************************
+
+	read_reg_response
+
+	reads the response data from a slave and puts the data into an
+	array.
+
+************************************************************************/
+
+int read_reg_response(int *dest, int dest_size, unsigned char *query,
+		      int fd)
+{
+
+	unsigned char data[MAX_RESPONSE_LENGTH];
+	int raw_response_length;
+
+
+
+	raw_response_length = modbus_response(data, query, fd);
+	if (raw_response_length > 0) {
+		decode_registers(data, raw_response_length, dest, dest_size);
+		raw_response_length -= 2;
+	}
+
+	return (raw_response_length);
+}
+
+
+
+
+
+/***********************************************************************
+
+	set_write_hook / report_write
+
+	lets a layer above (see modbus_cache.h) hear about every write
+	a slave has accepted.
+
+***********************************************************************/
+
+static modbus_write_hook write_hook;
+static void *write_hook_arg;
+
+void set_write_hook(modbus_write_hook hook, void *arg)
+{
+	write_hook = hook;
+	write_hook_arg = arg;
+}
+
+void report_write(int fd, unsigned char *query, int status)
+{
+	int count;
+
+	if (!write_hook || status <= 0)
+		return;
+
+	switch (query[1]) {
+	case 0x05:
+	case 0x06:
+		count = 1;
+		break;
+	case 0x0F:
+	case 0x10:
+		count = (query[4] << 8) | query[5];
+		break;
+	case 0x17:
+		/* the write half of the query */
+		write_hook(write_hook_arg, fd, query[0], query[1],
+			   ((query[6] << 8) | query[7]) + 1,
+			   (query[8] << 8) | query[9]);
+		return;
+	default:
+		return;
+	}
+
+	write_hook(write_hook_arg, fd, query[0], query[1],
+		   ((query[2] << 8) | query[3]) + 1, count);
+}
+
+
+
+
+/************************************************************************
+
+	read_holding_registers16 / read_input_registers16
+
+	same as the calls without 16, into an array of uint16_t.
+
+************************************************************************/
+
+static int read_registers16(int function, int slave, int start_addr,
+			    int count, uint16_t *dest, int dest_size,
+			    int ttyfd)
+{
+	unsigned char packet[REQUEST_QUERY_SIZE + CHECKSUM_SIZE];
+	unsigned char data[MAX_RESPONSE_LENGTH];
+	int status;
+
+	build_request_packet(slave, function, start_addr, count, packet);
+
+	if (send_query(ttyfd, packet, REQUEST_QUERY_SIZE) < 0)
+		return (PORT_FAILURE);
 
-	read_reg_response
+	status = modbus_response(data, packet, ttyfd);
+	if (status > 0) {
+		decode_registers16(data, status, dest, dest_size);
+		status -= 2;
+	}
 
-	reads the response data from a slave and puts the data into an
-	array.
+	return (status);
+}
 
-************************************************************************/
 
-int read_reg_response(int *dest, int dest_size, unsigned char *query,
-		      int fd)
+int read_holding_registers16(int slave, int start_addr, int count,
+			     uint16_t *dest, int dest_size, int ttyfd)
 {
+	if (count > MAX_READ_REGS)
+		count = MAX_READ_REGS;
 
-	unsigned char data[MAX_RESPONSE_LENGTH];
-	int raw_response_length;
-	int temp, i;
-
-
+	return (read_registers16(0x03, slave, start_addr, count,
+				 dest, dest_size, ttyfd));
+}
 
-	raw_response_length = modbus_response(data, query, fd);
-	if (raw_response_length > 0)
-		raw_response_length -= 2;
 
+int read_input_registers16(int slave, int start_addr, int count,
+			   uint16_t *dest, int dest_size, int ttyfd)
+{
+	if (count > MAX_INPUT_REGS)
+		count = MAX_INPUT_REGS;
 
-	if (raw_response_length > 0) {
-		for (i = 0;
-		     i < (data[2] * 2) && i < (raw_response_length / 2);
-		     i++) {
-			/* shift reg hi_byte to temp */
-			temp = data[3 + i * 2] << 8;
-			/* OR with lo_byte           */
-			temp = temp | data[4 + i * 2];
-
-			dest[i] = temp;
-		}
-	}
-	return (raw_response_length);
+	return (read_registers16(0x04, slave, start_addr, count,
+				 dest, dest_size, ttyfd));
 }
 
 
@@ -615,6 +1172,7 @@ int preset_response(unsigned char *query, int fd)
 	int raw_response_length;
 
 	raw_response_length = modbus_response(data, query, fd);
+	report_write(fd, query, raw_response_length);
 
 	return (raw_response_length);
 }
@@ -637,16 +1195,12 @@ int set_single(int function, int slave, int addr, int value, int fd)
 
 	int status;
 
-	unsigned char packet[REQUEST_QUERY_SIZE];
-	packet[0] = slave;
-	packet[1] = function;
-	addr -= 1;
-	packet[2] = addr >> 8;
-	packet[3] = addr & 0x00FF;
-	packet[4] = value >> 8;
-	packet[5] = value & 0x00FF;
-
-	if (send_query(fd, packet, 6) > -1) {
+	unsigned char packet[REQUEST_QUERY_SIZE + CHECKSUM_SIZE];
+
+	/* same layout as a read request, with the value as the count */
+	build_request_packet(slave, function, addr, value, packet);
+
+	if (send_query(fd, packet, REQUEST_QUERY_SIZE) > -1) {
 		status = preset_response(packet, fd);
 	} else {
 		status = PORT_FAILURE;
@@ -712,29 +1266,24 @@ int preset_single_register(int slave, int reg_addr, int value, int fd)
 	set_multiple_coils
 
 	Takes an array of ints and sets or resets the coils on a slave
-	appropriatly.
+	appropriatly. build_coils_packet() puts the query together and
+	returns its length without the checksum.
 
 *************************************************************************/
 
-#define PRESET_QUERY_SIZE 210
+#define PRESET_QUERY_SIZE MAX_QUERY_LENGTH
 
-int set_multiple_coils(int slave, int start_addr, int coil_count,
-		       int *data, int fd)
+int build_coils_packet(int slave, int start_addr, int coil_count,
+		       int *data, unsigned char *packet)
 {
 	int byte_count;
 	int i, bit, packet_size = 6;
 	int coil_check = 0;
 	int data_array_pos = 0;
-	int status;
 
-	unsigned char packet[PRESET_QUERY_SIZE];
+	if (coil_count > MAX_PDU_WRITE_COILS)
+		coil_count = MAX_PDU_WRITE_COILS;
 
-	if (coil_count > MAX_WRITE_COILS) {
-		coil_count = MAX_WRITE_COILS;
-#ifdef DEBUG
-		fprintf(stderr, "Writing to too many coils.\n");
-#endif
-	}
 	packet[0] = slave;
 	packet[1] = 0x0F;
 	start_addr -= 1;
@@ -742,7 +1291,7 @@ int set_multiple_coils(int slave, int start_addr, int coil_count,
 	packet[3] = start_addr & 0x00FF;
 	packet[4] = coil_count >> 8;
 	packet[5] = coil_count & 0x00FF;
-	byte_count = (coil_count / 8) + 1;
+	byte_count = (coil_count + 7) / 8;
 	packet[6] = byte_count;
 
 	bit = 0x01;
@@ -761,7 +1310,29 @@ int set_multiple_coils(int slave, int start_addr, int coil_count,
 		bit = 0x01;
 	}
 
-	if (send_query(fd, packet, ++packet_size) > -1) {
+	return (++packet_size);
+}
+
+
+int set_multiple_coils(int slave, int start_addr, int coil_count,
+		       int *data, int fd)
+{
+	int packet_size;
+	int status;
+
+	unsigned char packet[PRESET_QUERY_SIZE];
+
+	if (coil_count > MAX_WRITE_COILS) {
+		coil_count = MAX_WRITE_COILS;
+#ifdef DEBUG
+		fprintf(stderr, "Writing to too many coils.\n");
+#endif
+	}
+
+	packet_size = build_coils_packet(slave, start_addr, coil_count,
+					 data, packet);
+
+	if (send_query(fd, packet, packet_size) > -1) {
 		status = preset_response(packet, fd);
 	} else {
 		status = PORT_FAILURE;
@@ -774,29 +1345,84 @@ int set_multiple_coils(int slave, int start_addr, int coil_count,
 
 
 
+/*************************************************************************
+
+	set_multiple_coils_packed
+
+	same as set_multiple_coils(), from packed bits. They go into
+	the query as they are, except for the padding of the last
+	byte, which is cleared.
+
+***************************************************************************/
+
+int build_coils_packet_packed(int slave, int start_addr, int coil_count,
+			      const unsigned char *bits,
+			      unsigned char *packet)
+{
+	int byte_count;
+
+	if (coil_count > MAX_PDU_WRITE_COILS)
+		coil_count = MAX_PDU_WRITE_COILS;
+	if (coil_count < 0)
+		coil_count = 0;
+
+	packet[0] = slave;
+	packet[1] = 0x0F;
+	start_addr -= 1;
+	packet[2] = start_addr >> 8;
+	packet[3] = start_addr & 0x00FF;
+	packet[4] = coil_count >> 8;
+	packet[5] = coil_count & 0x00FF;
+	byte_count = COIL_BYTES(coil_count);
+	packet[6] = byte_count;
+
+	memcpy(packet + 7, bits, byte_count);
+	if (coil_count & 7)
+		packet[6 + byte_count] &= (1 << (coil_count & 7)) - 1;
+
+	return (7 + byte_count);
+}
+
+
+int set_multiple_coils_packed(int slave, int start_addr, int coil_count,
+			      const unsigned char *bits, int fd)
+{
+	unsigned char packet[PRESET_QUERY_SIZE];
+	int packet_size;
+
+	if (coil_count > MAX_WRITE_COILS)
+		coil_count = MAX_WRITE_COILS;
+
+	packet_size = build_coils_packet_packed(slave, start_addr,
+						coil_count, bits, packet);
+
+	if (send_query(fd, packet, packet_size) < 0)
+		return (PORT_FAILURE);
+
+	return (preset_response(packet, fd));
+}
+
+
+
+
+
 /*************************************************************************
 
 	preset_multiple_registers
 
 	copy the values in an array to an array on the slave.
+	build_registers_packet() puts the query together and returns
+	its length without the checksum.
 
 ***************************************************************************/
 
-int preset_multiple_registers(int slave, int start_addr,
-			      int reg_count, int *data, int fd)
+int build_registers_packet(int slave, int start_addr, int reg_count,
+			   int *data, unsigned char *packet)
 {
 	int byte_count, i, packet_size = 6;
-	int status;
-
-	unsigned char packet[PRESET_QUERY_SIZE];
 
-	if (reg_count > MAX_WRITE_REGS) {
-		reg_count = MAX_WRITE_REGS;
-#ifdef DEBUG
-		fprintf(stderr,
-			"Trying to write to too many registers.\n");
-#endif
-	}
+	if (reg_count > MAX_PDU_WRITE_REGS)
+		reg_count = MAX_PDU_WRITE_REGS;
 
 	packet[0] = slave;
 	packet[1] = 0x10;
@@ -813,7 +1439,30 @@ int preset_multiple_registers(int slave, int start_addr,
 		packet[++packet_size] = data[i] & 0x00FF;
 	}
 
-	if (send_query(fd, packet, ++packet_size) > -1) {
+	return (++packet_size);
+}
+
+
+int preset_multiple_registers(int slave, int start_addr,
+			      int reg_count, int *data, int fd)
+{
+	int packet_size;
+	int status;
+
+	unsigned char packet[PRESET_QUERY_SIZE];
+
+	if (reg_count > MAX_WRITE_REGS) {
+		reg_count = MAX_WRITE_REGS;
+#ifdef DEBUG
+		fprintf(stderr,
+			"Trying to write to too many registers.\n");
+#endif
+	}
+
+	packet_size = build_registers_packet(slave, start_addr, reg_count,
+					     data, packet);
+
+	if (send_query(fd, packet, packet_size) > -1) {
 		status = preset_response(packet, fd);
 	} else {
 		status = PORT_FAILURE;
@@ -826,60 +1475,295 @@ int preset_multiple_registers(int slave, int start_addr,
 
 
 
+/*************************************************************************
+
+	read_write_registers
+
+	writes to and reads from the holding registers of a slave in one
+	transaction (function 23). build_read_write_packet() puts the
+	query together and returns its length without the checksum.
+
+***************************************************************************/
+
+int build_read_write_packet(int slave, int read_addr, int read_count,
+			    int write_addr, int write_count, int *data,
+			    unsigned char *packet)
+{
+	int i, packet_size = 10;
+
+	if (read_count > MAX_PDU_READ_REGS)
+		read_count = MAX_PDU_READ_REGS;
+	if (write_count > MAX_PDU_RW_WRITE_REGS)
+		write_count = MAX_PDU_RW_WRITE_REGS;
+	if (write_count < 0)
+		write_count = 0;
+
+	packet[0] = slave;
+	packet[1] = 0x17;
+	read_addr -= 1;
+	packet[2] = read_addr >> 8;
+	packet[3] = read_addr & 0x00FF;
+	packet[4] = read_count >> 8;
+	packet[5] = read_count & 0x00FF;
+	write_addr -= 1;
+	packet[6] = write_addr >> 8;
+	packet[7] = write_addr & 0x00FF;
+	packet[8] = write_count >> 8;
+	packet[9] = write_count & 0x00FF;
+	packet[10] = write_count * 2;
+
+	for (i = 0; i < write_count; i++) {
+		packet[++packet_size] = data[i] >> 8;
+		packet[++packet_size] = data[i] & 0x00FF;
+	}
+
+	return (++packet_size);
+}
+
+
+int read_write_registers(int slave, int read_addr, int read_count,
+			 int *dest, int dest_size, int write_addr,
+			 int write_count, int *data, int fd)
+{
+	unsigned char packet[PRESET_QUERY_SIZE];
+	unsigned char reply[MAX_RESPONSE_LENGTH];
+	int packet_size;
+	int status;
+
+	packet_size = build_read_write_packet(slave, read_addr, read_count,
+					      write_addr, write_count, data,
+					      packet);
+
+	if (send_query(fd, packet, packet_size) < 0)
+		return (PORT_FAILURE);
+
+	status = modbus_response(reply, packet, fd);
+	report_write(fd, packet, status);
+	if (status > 0) {
+		decode_registers(reply, status, dest, dest_size);
+		status -= 2;
+	}
+
+	return (status);
+}
+
+
+
+
+
+/*************************************************************************
+
+	preset_multiple_registers16
+
+	same as preset_multiple_registers(), from an array of uint16_t.
+	build_registers_packet16() encodes it with be16_encode().
 
+***************************************************************************/
 
+int build_registers_packet16(int slave, int start_addr, int reg_count,
+			     const uint16_t *data, unsigned char *packet)
+{
+	if (reg_count > MAX_PDU_WRITE_REGS)
+		reg_count = MAX_PDU_WRITE_REGS;
+	if (reg_count < 0)
+		reg_count = 0;
 
+	packet[0] = slave;
+	packet[1] = 0x10;
+	start_addr -= 1;
+	packet[2] = start_addr >> 8;
+	packet[3] = start_addr & 0x00FF;
+	packet[4] = reg_count >> 8;
+	packet[5] = reg_count & 0x00FF;
+	packet[6] = reg_count * 2;
 
+	be16_encode(packet + 7, data, reg_count);
 
+	return (7 + reg_count * 2);
+}
 
-/****************************************************************************
-***************************** [  BEGIN:  crc ] ******************************
-*****************************************************************************
-INPUTS:
-	buf   ->  Array containing message to be sent to controller.            	start ->  Start of loop in crc counter, usually 0.
-	cnt   ->  Amount of bytes in message being sent to controller/
-OUTPUTS:
-	temp  ->  Returns crc byte for message.
-COMMENTS:
-	This routine calculates the crc high and low byte of a message.
-	Note that this crc is only used for Modbus, not Modbus+ etc. 
-****************************************************************************/
 
-unsigned int crc(unsigned char *buf, int start, int cnt)
+int preset_multiple_registers16(int slave, int start_addr, int reg_count,
+				const uint16_t *data, int fd)
 {
-	int i, j;
-	unsigned temp, temp2, flag;
+	unsigned char packet[PRESET_QUERY_SIZE];
+	int packet_size;
 
-	temp = 0xFFFF;
-#ifdef DEBUG_CHITO
-	fprintf(stderr, "crc: string length %d\n", cnt);
-#endif
-	for (i = start; i < cnt; i++) {
-		temp = temp ^ buf[i];
-
-		for (j = 1; j <= 8; j++) {
-			flag = temp & 0x0001;
-			temp = temp >> 1;
-			if (flag)
-				temp = temp ^ 0xA001;
-		}
+	if (reg_count > MAX_WRITE_REGS)
+		reg_count = MAX_WRITE_REGS;
+
+	packet_size = build_registers_packet16(slave, start_addr, reg_count,
+					       data, packet);
+
+	if (send_query(fd, packet, packet_size) < 0)
+		return (PORT_FAILURE);
+
+	return (preset_response(packet, fd));
+}
+
+
+
+
+
+/*************************************************************************
+
+	the _bulk calls
+
+	split a range of any size into requests of the largest size
+	the protocol allows and run them back to back; send_query()
+	keeps the gap between them down to t3.5. Every chunk is tried,
+	even after one has failed, and its return value goes into
+	chunk_status if there is room for it.
+
+	Returns:	the number of chunks that failed
+
+***************************************************************************/
+
+static void set_chunk_status(int *chunk_status, int max_chunks, int chunk,
+			     int status)
+{
+	if (chunk_status && chunk < max_chunks)
+		chunk_status[chunk] = status;
+}
+
+
+static int read_registers_bulk(int function, int slave, int start_addr,
+			       int count, int *dest, int dest_size,
+			       int *chunk_status, int max_chunks, int fd)
+{
+	int chunk, n, status, failed = 0;
+
+	if (count > dest_size)
+		count = dest_size;
+
+	for (chunk = 0; count > 0; chunk++) {
+		n = count < MAX_PDU_READ_REGS ? count : MAX_PDU_READ_REGS;
+
+		status = read_registers(function, slave, start_addr, n,
+					dest, n, fd);
+		set_chunk_status(chunk_status, max_chunks, chunk, status);
+		if (status <= 0)
+			failed++;
+
+		start_addr += n;
+		dest += n;
+		count -= n;
 	}
 
-	/* Reverse byte order. */
+	return (failed);
+}
+
+
+int read_holding_registers_bulk(int slave, int start_addr, int count,
+				int *dest, int dest_size,
+				int *chunk_status, int max_chunks, int fd)
+{
+	return (read_registers_bulk(0x03, slave, start_addr, count,
+				    dest, dest_size,
+				    chunk_status, max_chunks, fd));
+}
+
+
+int read_input_registers_bulk(int slave, int start_addr, int count,
+			      int *dest, int dest_size,
+			      int *chunk_status, int max_chunks, int fd)
+{
+	return (read_registers_bulk(0x04, slave, start_addr, count,
+				    dest, dest_size,
+				    chunk_status, max_chunks, fd));
+}
+
+
+int set_multiple_coils_bulk(int slave, int start_addr, int coil_count,
+			    int *data, int *chunk_status, int max_chunks,
+			    int fd)
+{
+	unsigned char packet[PRESET_QUERY_SIZE];
+	int chunk, n, packet_size, status, failed = 0;
+
+	for (chunk = 0; coil_count > 0; chunk++) {
+		n = coil_count < MAX_PDU_WRITE_COILS
+		    ? coil_count : MAX_PDU_WRITE_COILS;
+
+		packet_size = build_coils_packet(slave, start_addr, n,
+						 data, packet);
+		if (send_query(fd, packet, packet_size) > -1)
+			status = preset_response(packet, fd);
+		else
+			status = PORT_FAILURE;
+		set_chunk_status(chunk_status, max_chunks, chunk, status);
+		if (status <= 0)
+			failed++;
+
+		start_addr += n;
+		data += n;
+		coil_count -= n;
+	}
+
+	return (failed);
+}
+
+
+int preset_multiple_registers_bulk(int slave, int start_addr,
+				   int reg_count, int *data,
+				   int *chunk_status, int max_chunks, int fd)
+{
+	unsigned char packet[PRESET_QUERY_SIZE];
+	int chunk, n, packet_size, status, failed = 0;
+
+	for (chunk = 0; reg_count > 0; chunk++) {
+		n = reg_count < MAX_PDU_WRITE_REGS
+		    ? reg_count : MAX_PDU_WRITE_REGS;
+
+		packet_size = build_registers_packet(slave, start_addr, n,
+						     data, packet);
+		if (send_query(fd, packet, packet_size) > -1)
+			status = preset_response(packet, fd);
+		else
+			status = PORT_FAILURE;
+		set_chunk_status(chunk_status, max_chunks, chunk, status);
+		if (status <= 0)
+			failed++;
+
+		start_addr += n;
+		data += n;
+		reg_count -= n;
+	}
+
+	return (failed);
+}
+
+
+
+
+
 
-	temp2 = temp >> 8;
-	temp = (temp << 8) | temp2;
-	temp &= 0xFFFF;
 
-#ifdef DEBUG_CHITO
-	fprintf(stderr, "crc: temp crc %0.2X\n", temp);
-#endif
 
-	return (temp);
+
+
+
+/* MODBUS_TRACE=records turns the frame trace on, printed to stderr */
+static void trace_from_env(void)
+{
+	static int checked;
+	char *env;
+	int records;
+
+	if (checked)
+		return;
+	checked = 1;
+
+	if (!(env = getenv("MODBUS_TRACE")))
+		return;
+	records = atoi(env);
+	if (trace_start(records > 0 ? records : TRACE_DEFAULT_RECORDS) == 0)
+		trace_print_thread(stderr);
 }
 
 
 
+
 /************************************************************************
 
 	set_up_comms
@@ -904,54 +1788,52 @@ int set_up_comms(char *device, int baud_i, char *parity)
 	switch (baud_i) {
 	case 110:
 		baud_rate = B110;
-		char_interval_timeout = TO_B110;
 		break;
 	case 300:
 		baud_rate = B300;
-		char_interval_timeout = TO_B300;
 		break;
 	case 600:
 		baud_rate = B600;
-		char_interval_timeout = TO_B600;
 		break;
 	case 1200:
 		baud_rate = B1200;
-		char_interval_timeout = TO_B1200;
 		break;
 	case 2400:
 		baud_rate = B2400;
-		char_interval_timeout = TO_B2400;
 		break;
 	case 4800:
 		baud_rate = B4800;
-		char_interval_timeout = TO_B4800;
 		break;
 	case 9600:
 	case 0:
 		baud_rate = B9600;
-		char_interval_timeout = TO_B9600;
 		break;
 	case 19200:
 		baud_rate = B19200;
-		char_interval_timeout = TO_B19200;
 		break;
 	case 38400:
 		baud_rate = B38400;
-		char_interval_timeout = TO_B38400;
 		break;
 	case 57600:
 		baud_rate = B57600;
-		char_interval_timeout = TO_B57600;
 		break;
 	case 115200:
 		baud_rate = B115200;
-		char_interval_timeout = TO_B115200;
+		break;
+	case 230400:
+		baud_rate = B230400;
+		break;
+	case 460800:
+		baud_rate = B460800;
+		break;
+	case 921600:
+		baud_rate = B921600;
 		break;
 	default:
 		baud_rate = B9600;
-		char_interval_timeout = TO_B9600;
 		fprintf(stderr, "Unknown baud rate %d for %s.", baud_i,
 			device);
+		baud_i = 9600;
 	}
 
 
@@ -970,6 +1852,11 @@ int set_up_comms(char *device, int baud_i, char *parity)
 	/* read your man page for the meaning of all this. # man termios */
 	/* Its a bit to involved to comment here                         */
 
+	/* start from what the port has, the flags not set below included */
+	if (tcgetattr(ttyfd, &settings) < 0) {
+		fprintf(stderr, "tcgetattr failed on %s\n", device);
+		exit(1);
+	}
 
 	cfsetispeed(&settings, baud_rate);	/* Set the baud rate */
 	cfsetospeed(&settings, baud_rate);
@@ -990,11 +1877,11 @@ int set_up_comms(char *device, int baud_i, char *parity)
 	settings.c_iflag &= ~IXOFF;
 	settings.c_iflag &= ~IMAXBEL;
 
-	settings.c_oflag |= OPOST;
+	settings.c_oflag &= ~OPOST;	/* raw bytes out, ONOCR would eat 0x0D */
 	settings.c_oflag &= ~OLCUC;
 	settings.c_oflag &= ~ONLCR;
 	settings.c_oflag &= ~OCRNL;
-	settings.c_oflag |= ONOCR;
+	settings.c_oflag &= ~ONOCR;
 	settings.c_oflag &= ~ONLRET;
 	settings.c_oflag &= ~OFILL;
 	settings.c_oflag &= ~OFDEL;
@@ -1022,7 +1909,7 @@ int set_up_comms(char *device, int baud_i, char *parity)
 	settings.c_lflag &= ~ISIG;
 	settings.c_lflag &= ~ICANON;
 	settings.c_lflag &= ~ECHO;
-	settings.c_lflag |= IEXTEN;
+	settings.c_lflag &= ~IEXTEN;
 
 	settings.c_cc[VMIN] = 0;
 	settings.c_cc[VTIME] = 0;
@@ -1032,5 +1919,27 @@ int set_up_comms(char *device, int baud_i, char *parity)
 		exit(1);
 	}
 
+	/* the timing of the line and a free bus from now on */
+	if (!port_open(ttyfd, baud_i, parity)) {
+		fprintf(stderr, "out of memory for %s\n", device);
+		exit(1);
+	}
+	trace_from_env();
+
 	return (ttyfd);
 }
+
+
+
+
+/***********************************************************************
+
+	close_comms( file_descriptor )
+
+***********************************************************************/
+
+void close_comms(int ttyfd)
+{
+	port_close(ttyfd);
+	close(ttyfd);
+}
@@ -26,6 +26,13 @@
 #ifndef MODBUS_RTU_H
 #define MODBUS_RTU_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define MAX_DATA_LENGTH 246
 #define MAX_QUERY_LENGTH 256
 #define MAX_RESPONSE_LENGTH 256
@@ -193,6 +200,121 @@ int preset_multiple_registers( int slave, int start_addr,
 
 
 
+/*************************************************************************
+
+	read_write_registers()
+
+	writes write_count registers from data at write_addr and reads
+	read_count registers at read_addr into dest, in one transaction
+	(function 23). The slave writes before it reads. At most 125
+	registers are read and 121 written.
+
+*************************************************************************/
+
+int read_write_registers( int slave, int read_addr, int read_count,
+			  int *dest, int dest_size, int write_addr,
+			  int write_count, int *data, int fd );
+
+
+
+
+
+
+/*************************************************************************
+
+	read_holding_registers_bulk()	read_input_registers_bulk()
+	set_multiple_coils_bulk()	preset_multiple_registers_bulk()
+
+	same as the calls above, but for ranges of any size. The range
+	is split into chunks of the most one request may carry (125
+	registers read, 123 written, 1968 coils written), sent back to
+	back. Chunk i starts i chunks past start_addr; its return value
+	goes into chunk_status[i] if i < max_chunks. chunk_status may
+	be NULL. Reads stop at dest_size.
+
+	Returns:	0 if every chunk went through
+			the number of chunks that failed otherwise
+
+*************************************************************************/
+
+int read_holding_registers_bulk( int slave, int start_addr, int count,
+				 int *dest, int dest_size,
+				 int *chunk_status, int max_chunks, int fd );
+
+int read_input_registers_bulk( int slave, int start_addr, int count,
+			       int *dest, int dest_size,
+			       int *chunk_status, int max_chunks, int fd );
+
+int set_multiple_coils_bulk( int slave, int start_addr, int coil_count,
+			     int *data, int *chunk_status, int max_chunks,
+			     int fd );
+
+int preset_multiple_registers_bulk( int slave, int start_addr,
+				    int reg_count, int *data,
+				    int *chunk_status, int max_chunks,
+				    int fd );
+
+
+
+
+
+
+
+
+/*************************************************************************
+
+	read_coil_status_packed()	read_input_status_packed()
+	set_multiple_coils_packed()
+
+	same as the calls without _packed, for coils kept as packed
+	bits (see modbus_bits.h): coil start_addr + n is bit n % 8 of
+	byte n / 8. The bytes go between the frame and the caller's
+	array as they are. dest_bytes is the size of dest in bytes.
+
+*************************************************************************/
+
+int read_coil_status_packed( int slave, int start_addr, int count,
+			     unsigned char *dest, int dest_bytes, int fd );
+
+int read_input_status_packed( int slave, int start_addr, int count,
+			      unsigned char *dest, int dest_bytes, int fd );
+
+int set_multiple_coils_packed( int slave, int start_addr, int coil_count,
+			       const unsigned char *bits, int fd );
+
+
+
+
+
+
+
+
+/*************************************************************************
+
+	read_holding_registers16()	read_input_registers16()
+	preset_multiple_registers16()
+
+	same as the calls without 16, for registers kept as uint16_t.
+	The registers are converted straight between the frame and
+	the caller's array, with vector byte swaps where the CPU has
+	them (see modbus_be16.h).
+
+*************************************************************************/
+
+int read_holding_registers16( int slave, int start_addr, int count,
+			      uint16_t *dest, int dest_size, int fd );
+
+int read_input_registers16( int slave, int start_addr, int count,
+			    uint16_t *dest, int dest_size, int fd );
+
+int preset_multiple_registers16( int slave, int start_addr, int reg_count,
+				 const uint16_t *data, int fd );
+
+
+
+
+
+
 
 
 /***************************************************************************
@@ -211,19 +333,187 @@ int set_up_comms( char *device, int baud, char *parity );
  * uses 9600. */
 
 
-#define TO_B110	3200000	/* These values are the timeout delays */
-#define TO_B300 1600000	/* at the end of packets of data.      */
-#define TO_B600  800000 /* At this stage a true calculation    */
-#define TO_B1200 400000	/* has not been worked out. So these   */
-#define TO_B2400 200000	/* values are just a guess.            */
-#define TO_B4800 100000	/*                                     */
-#define TO_B9600  50000	/* The spec says that a message frame  */
-#define TO_B19200 25000	/* starts after a silent interval of   */
-#define TO_B38400 12500 /* at least 3.5 character times.       */
-#define TO_B57600  8333 /* These are uS times.                */
-#define TO_B115200 4167 
+/* set_up_comms() also works out the silent intervals of the line from
+ * the baud rate and character format, see compute_char_timing(). They
+ * are kept with the port (see modbus_port.h), so ports at different
+ * speeds can be used side by side, and by many threads at once. */
+
+void close_comms( int fd );
+/* closes a port set up by set_up_comms(), and forgets its timing,
+ * counters and broadcast delay, so a port opened later on the same fd
+ * number starts afresh. No transaction may be running on it. */
+
+
+
+
+/***************************************************************************
+
+	set_broadcast_delay
+
+	The write calls (force_single_coil(), preset_single_register(),
+	set_multiple_coils(), preset_multiple_registers() and their
+	variants) with slave BROADCAST_ADDRESS go to every slave on the
+	line. No slave answers a broadcast, so the call returns as soon
+	as the query is written, with the length an answer would have
+	had. The next query on the port waits for the turnaround delay
+	after the broadcast, giving the slaves time to carry it out.
+
+	set_broadcast_delay() sets that delay for a port, in uS. A bus
+	of an rtu_loop takes the delay its port has when it is added.
+
+***************************************************************************/
+
+#define BROADCAST_ADDRESS 0
+#define BROADCAST_DELAY 100000	/* uS, the default turnaround delay */
+
+void set_broadcast_delay( int fd, long usec );
+
+
+
+
+/***************************************************************************
+
+	compute_char_timing
+
+	Fills in the character time and the t1.5 / t3.5 silent
+	intervals for a line. char_bits is the number of bits in one
+	character: start, 8 data, parity and stop bits (11 for 8E1).
+
+	The spec says that a message frame starts after a silent
+	interval of at least 3.5 character times, and characters of
+	one frame are no more than 1.5 character times apart. Above
+	19200 bps both are fixed.
+
+	The master waits t3.5 after the last frame on the bus before
+	sending the next query, so there is no need to sleep() between
+	calls.
+
+***************************************************************************/
+
+#define T15_FLOOR  750	/* uS, t1.5 above 19200 bps */
+#define T35_FLOOR 1750	/* uS, t3.5 above 19200 bps */
+
+#define RX_LATENCY_SLACK 20000	/* uS. USB adapters hand over the bytes */
+				/* of a frame in bursts, allow for that */
+				/* between bursts of a known length frame */
+
+struct modbus_timing {
+	long char_ns;	/* nS to send one character */
+	int t15;	/* uS */
+	int t35;	/* uS */
+};
+
+void compute_char_timing( int baud, int char_bits, struct modbus_timing *t );
+
+/* the same for the current settings of an open port */
+int get_line_timing( int ttyfd, struct modbus_timing *t );
+
+
+
+
+/***************************************************************************
+
+	Low level functions
+
+	The building blocks of the calls above, for code that moves the
+	frames itself (see modbus_loop.h). A query is built into a buffer
+	with 2 spare bytes, modbus_query() appends the checksum, and the
+	reply is checked and decoded with the same code the blocking
+	calls use, so both produce the same bytes on the wire.
+
+***************************************************************************/
+
+void build_request_packet( int slave, int function, int start_addr,
+			   int count, unsigned char *packet );
+
+/* the reads behind the calls above, without their count clamping; */
+/* function is 0x01/0x02 for read_IO_status(), 0x03/0x04 for        */
+/* read_registers()                                                 */
+#define MAX_PDU_READ_BITS 2000	/* the most one request may ask for */
+#define MAX_PDU_READ_REGS 125
+#define MAX_PDU_WRITE_COILS 1968
+#define MAX_PDU_WRITE_REGS 123
+#define MAX_PDU_RW_WRITE_REGS 121	/* written by one FC23 request */
+
+int read_IO_status( int function, int slave, int start_addr, int count,
+		    int *dest, int dest_size, int ttyfd );
+
+int read_registers( int function, int slave, int start_addr, int count,
+		    int *dest, int dest_size, int ttyfd );
+
+/* FC15 and FC16 queries, clamped to the protocol limits. They */
+/* return the query length without the checksum                 */
+int build_coils_packet( int slave, int start_addr, int coil_count,
+			int *data, unsigned char *packet );
+
+int build_coils_packet_packed( int slave, int start_addr, int coil_count,
+			       const unsigned char *bits,
+			       unsigned char *packet );
+
+int build_registers_packet( int slave, int start_addr, int reg_count,
+			    int *data, unsigned char *packet );
+
+int build_registers_packet16( int slave, int start_addr, int reg_count,
+			      const uint16_t *data, unsigned char *packet );
+
+/* FC23 query, clamped the same way; also without the checksum */
+int build_read_write_packet( int slave, int read_addr, int read_count,
+			     int write_addr, int write_count, int *data,
+			     unsigned char *packet );
+
+void modbus_query( unsigned char *packet, size_t string_length );
+
+/* send_query() holds the port for the transaction until           */
+/* modbus_response() is called; other threads wait for it in turn */
+int send_query( int ttyfd, unsigned char *query, size_t string_length );
+
+int modbus_response( unsigned char *data, unsigned char *query, int fd );
+
+/* length of the normal reply to query, checksum included; 0 if unknown */
+int expected_response_length( unsigned char *query );
+
+/* what a call returns for a broadcast query: the length of the reply */
+/* a write would have had, 0 for anything else                         */
+int broadcast_status( unsigned char *query );
+
+/* expected length refined from the first bytes_received of a reply */
+int frame_length( unsigned char *data, int bytes_received, int expected );
+
+/* called with the slave, function code (0x05, 0x06, 0x0F, 0x10 or */
+/* 0x17), first address and count of every write a slave has        */
+/* accepted; one hook at a time, NULL to remove it                   */
+typedef void (*modbus_write_hook)( void *arg, int fd, int slave,
+				   int function, int addr, int count );
+
+void set_write_hook( modbus_write_hook hook, void *arg );
+
+/* calls the hook for query if it is a write and status is > 0 */
+void report_write( int fd, unsigned char *query, int status );
+
+/* CRC and exception check of a complete reply, same return values */
+/* as the calls above                                              */
+int check_response( unsigned char *data, int response_length,
+		    unsigned char *query );
+
+/* reply to FC01/02 into TRUE/FALSE elements, FC03/04 into registers */
+int decode_bits( unsigned char *data, int length, int count,
+		 int *dest, int dest_size );
+
+/* the bits of a FC01/FC02 reply as they are, returns the coil count */
+int decode_bits_packed( unsigned char *data, int length, int count,
+			unsigned char *dest, int dest_bytes );
+
+int decode_registers( unsigned char *data, int length,
+		      int *dest, int dest_size );
+
+int decode_registers16( unsigned char *data, int length,
+			uint16_t *dest, int dest_size );
+
 
 
 
+#ifdef __cplusplus
+}
+#endif
 
 #endif  /* MODBUS_RTU_H */
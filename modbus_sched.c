@@ -0,0 +1,255 @@
+/* modbus_sched.c
+
+   Rate based polling scheduler for the RTU master.
+
+   Every item has a release time (when it is due) and a deadline one
+   period later. Of the items that are due the one with the earliest
+   deadline goes on the bus first, so short periods are not starved by
+   long reads and nothing drifts when the bus is busy. The reads
+   themselves are the usual read_*() calls, which already wait the t3.5
+   gap and nothing more, so the bus is kept as busy as the line allows.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include <errno.h>
+#include "modbus_rtu.h"
+#include "modbus_sched.h"
+
+
+/* a - b in uS */
+static long ts_diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000L
+	    + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+static void ts_add_us(struct timespec *ts, long us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_nsec -= 1000000000L;
+		ts->tv_sec++;
+	}
+}
+
+
+
+
+/************************************************************************
+
+	sched_init
+
+	resets the statistics and makes every item due now.
+
+*************************************************************************/
+
+void sched_init(struct poll_scheduler *sched, int fd,
+		struct poll_item *items, int n_items)
+{
+	int i;
+
+	sched->fd = fd;
+	sched->items = items;
+	sched->n_items = n_items;
+	clock_gettime(CLOCK_MONOTONIC, &sched->started);
+
+	for (i = 0; i < n_items; i++) {
+		items[i].last_status = 0;
+		items[i].polls = 0;
+		items[i].errors = 0;
+		items[i].skipped = 0;
+		items[i].max_lateness = 0;
+		items[i].sum_lateness = 0;
+		items[i].release = sched->started;
+		if (items[i].period <= 0)
+			items[i].period = 1;
+	}
+}
+
+
+
+
+/************************************************************************
+
+	poll_item_read
+
+	does the read of one item.
+
+*************************************************************************/
+
+static int poll_item_read(struct poll_item *item, int fd)
+{
+	switch (item->function) {
+	case 0x01:
+		return read_coil_status(item->slave, item->start_addr,
+					item->count, item->dest,
+					item->dest_size, fd);
+	case 0x02:
+		return read_input_status(item->slave, item->start_addr,
+					 item->count, item->dest,
+					 item->dest_size, fd);
+	case 0x03:
+		return read_holding_registers(item->slave, item->start_addr,
+					      item->count, item->dest,
+					      item->dest_size, fd);
+	case 0x04:
+		return read_input_registers(item->slave, item->start_addr,
+					    item->count, item->dest,
+					    item->dest_size, fd);
+	}
+	return (ILLEGAL_FUNCTION);
+}
+
+
+
+
+/************************************************************************
+
+	sched_run_once
+
+	sleeps until at least one item is due, then runs the due item
+	with the earliest deadline.
+
+*************************************************************************/
+
+int sched_run_once(struct poll_scheduler *sched)
+{
+	struct poll_item *item;
+	struct timespec now, nap;
+	long lateness, best_deadline = 0, deadline, wait, behind = 0;
+	int i, best;
+
+	if (sched->n_items < 1)
+		return (-1);
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		/* earliest deadline among the released items, and how */
+		/* long until the next release if none is due yet      */
+		best = -1;
+		wait = -1;
+		for (i = 0; i < sched->n_items; i++) {
+			item = &sched->items[i];
+			lateness = ts_diff_us(&now, &item->release);
+			if (lateness < 0) {
+				if (wait < 0 || -lateness < wait)
+					wait = -lateness;
+				continue;
+			}
+			deadline = item->period - lateness;
+			if (best < 0 || deadline < best_deadline) {
+				best = i;
+				best_deadline = deadline;
+			}
+		}
+		if (best >= 0)
+			break;
+
+		nap.tv_sec = 0;
+		nap.tv_nsec = 0;
+		ts_add_us(&nap, wait);
+		while (nanosleep(&nap, &nap) < 0 && errno == EINTR);
+	}
+
+	item = &sched->items[best];
+	lateness = ts_diff_us(&now, &item->release);
+
+	item->last_status = poll_item_read(item, sched->fd);
+	item->polls++;
+	if (item->last_status <= 0)
+		item->errors++;
+	item->sum_lateness += lateness;
+	if (lateness > item->max_lateness)
+		item->max_lateness = lateness;
+
+	/* next release one period on, so the rate does not drift; */
+	/* drop whole periods we can no longer make up for, in one */
+	/* step however short the period                           */
+	ts_add_us(&item->release, item->period);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (item->period > 0)
+		behind = ts_diff_us(&now, &item->release) / item->period;
+	if (behind > 0) {
+		ts_add_us(&item->release, behind * item->period);
+		item->skipped += behind;
+	}
+
+	return (best);
+}
+
+
+
+
+/************************************************************************
+
+	sched_run
+
+	calls sched_run_once() for duration uS, forever if duration is 0.
+
+*************************************************************************/
+
+void sched_run(struct poll_scheduler *sched, long duration)
+{
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (sched_run_once(sched) < 0)
+			return;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (duration == 0 || ts_diff_us(&now, &start) < duration);
+}
+
+
+
+
+/************************************************************************
+
+	sched_report
+
+	one line per item: requested and achieved rate, average and
+	worst lateness, errors and dropped periods.
+
+*************************************************************************/
+
+void sched_report(struct poll_scheduler *sched, FILE *out)
+{
+	struct poll_item *item;
+	struct timespec now;
+	double elapsed;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = ts_diff_us(&now, &sched->started) / 1e6;
+	if (elapsed <= 0)
+		elapsed = 1e-6;
+
+	fprintf(out, "slave fc  start count   want/s    got/s  "
+		"avg late  max late   errors  skipped\n");
+	for (i = 0; i < sched->n_items; i++) {
+		item = &sched->items[i];
+		fprintf(out, "%5d %02X %6d %5d %8.2f %8.2f %7.0fus %7ldus "
+			"%8lu %8lu\n", item->slave, item->function,
+			item->start_addr, item->count,
+			item->period > 0 ? 1e6 / item->period : 0.0,
+			item->polls / elapsed,
+			item->polls ? item->sum_lateness / item->polls : 0.0,
+			item->max_lateness, item->errors, item->skipped);
+	}
+}
@@ -0,0 +1,146 @@
+/* 		modbus_sched.h
+
+   Rate based polling of a Modbus RTU bus.
+
+   A list of reads, each with its own period, is run on one serial line
+   in earliest deadline first order, back to back as fast as the line
+   timing allows.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_SCHED_H
+#define MODBUS_SCHED_H
+
+#include <stdio.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/************************************************************************
+
+	struct poll_item
+
+	one periodic read. function is 0x01 (coils), 0x02 (inputs),
+	0x03 (holding registers) or 0x04 (input registers); the result
+	goes into dest exactly as read_coil_status() and friends would
+	put it there.
+
+	The fields after dest_size are kept by the scheduler.
+
+*************************************************************************/
+
+struct poll_item {
+	int slave;
+	int function;
+	int start_addr;
+	int count;
+	long period;		/* uS between two polls */
+	int *dest;
+	int dest_size;
+
+	int last_status;	/* return value of the last read */
+	unsigned long polls;	/* reads done */
+	unsigned long errors;	/* reads that returned <= 0 */
+	unsigned long skipped;	/* periods dropped because we were late */
+	long max_lateness;	/* uS from release to start of the read */
+	double sum_lateness;	/* uS, for the average */
+	struct timespec release;	/* when the next read is due */
+};
+
+
+
+/************************************************************************
+
+	struct poll_scheduler
+
+	the bus and the items that run on it.
+
+*************************************************************************/
+
+struct poll_scheduler {
+	int fd;
+	struct poll_item *items;
+	int n_items;
+	struct timespec started;
+};
+
+
+
+/************************************************************************
+
+	sched_init()
+
+	resets the statistics and makes every item due now. A period
+	of 0 or less is taken as 1 uS: the item is polled back to back.
+
+*************************************************************************/
+
+void sched_init( struct poll_scheduler *sched, int fd,
+		 struct poll_item *items, int n_items );
+
+
+
+/************************************************************************
+
+	sched_run_once()
+
+	sleeps until at least one item is due, then runs the due item
+	with the earliest deadline (release + period).
+
+	Returns:	the index of the item that was run
+			-1 if there are no items
+
+*************************************************************************/
+
+int sched_run_once( struct poll_scheduler *sched );
+
+
+
+/************************************************************************
+
+	sched_run()
+
+	calls sched_run_once() for duration uS, forever if duration
+	is 0.
+
+*************************************************************************/
+
+void sched_run( struct poll_scheduler *sched, long duration );
+
+
+
+/************************************************************************
+
+	sched_report()
+
+	prints one line per item: requested and achieved poll rate,
+	average and worst lateness, errors and dropped periods.
+
+*************************************************************************/
+
+void sched_report( struct poll_scheduler *sched, FILE *out );
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MODBUS_SCHED_H */
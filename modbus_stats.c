@@ -0,0 +1,180 @@
+/* modbus_stats.c
+
+   Transaction timing and counters of the master.
+
+   The histograms are powers of two of microseconds, so adding an
+   entry is a count of leading zeros and a few increments; no
+   allocation, and the mutex is held for nothing else.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "modbus_rtu.h"
+#include "modbus_stats.h"
+
+static struct modbus_stats stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+
+long long stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+
+
+
+/* adds the time from start to end, both in nS */
+static void hist_add(struct modbus_histogram *h, long long start,
+		     long long end)
+{
+	unsigned long us;
+	int i;
+
+	if (!start || end < start)
+		return;
+
+	us = (end - start) / 1000;
+	i = us ? 8 * sizeof(long) - 1 - __builtin_clzl(us) : 0;
+	if (i >= STATS_BUCKETS)
+		i = STATS_BUCKETS - 1;
+
+	h->count++;
+	h->total_us += us;
+	if (us > h->max_us)
+		h->max_us = us;
+	h->bucket[i]++;
+}
+
+/* which counter an outcome goes to */
+static unsigned long *outcome(struct modbus_counters *c, int status,
+			      int rx_bytes)
+{
+	if (status > 0)
+		return (&c->ok);
+	if (status == PORT_FAILURE)
+		return (&c->port_failures);
+	if (status < 0)
+		return (&c->exceptions);
+	return (rx_bytes > 0 ? &c->crc_errors : &c->timeouts);
+}
+
+void stats_count(struct modbus_counters *c, int status, int rx_bytes)
+{
+	c->transactions++;
+	(*outcome(c, status, rx_bytes))++;
+}
+
+static void entry_add(struct modbus_stats_entry *e,
+		      const struct modbus_txn_times *t, int status,
+		      int rx_bytes)
+{
+	stats_count(&e->counters, status, rx_bytes);
+	hist_add(&e->round_trip, t->tx_start, t->done);
+}
+
+
+
+
+/*************************************************************************
+
+	stats_record
+
+**************************************************************************/
+
+void stats_record(const unsigned char *query,
+		  const struct modbus_txn_times *t, int status,
+		  int rx_bytes)
+{
+	pthread_mutex_lock(&stats_lock);
+	stats_count(&stats.total, status, rx_bytes);
+	stats.last = *t;
+
+	entry_add(&stats.slave[query[0]], t, status, rx_bytes);
+	if (query[1] < STATS_FUNCTIONS)
+		entry_add(&stats.function[query[1]], t, status, rx_bytes);
+
+	hist_add(&stats.round_trip, t->tx_start, t->done);
+	if (t->rx_first) {
+		hist_add(&stats.transmit, t->tx_start, t->tx_end);
+		hist_add(&stats.turnaround, t->tx_end, t->rx_first);
+		hist_add(&stats.reception, t->rx_first, t->rx_last);
+		hist_add(&stats.frame_end, t->rx_last, t->done);
+	}
+	pthread_mutex_unlock(&stats_lock);
+}
+
+
+
+
+/*************************************************************************
+
+	modbus_stats_snapshot / modbus_stats_reset
+
+**************************************************************************/
+
+void modbus_stats_snapshot(struct modbus_stats *out)
+{
+	pthread_mutex_lock(&stats_lock);
+	memcpy(out, &stats, sizeof(stats));
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void modbus_stats_reset(void)
+{
+	pthread_mutex_lock(&stats_lock);
+	memset(&stats, 0, sizeof(stats));
+	pthread_mutex_unlock(&stats_lock);
+}
+
+
+
+
+/*************************************************************************
+
+	stats_percentile
+
+**************************************************************************/
+
+unsigned long stats_percentile(const struct modbus_histogram *h,
+			       double frac)
+{
+	unsigned long want, seen = 0;
+	int i;
+
+	if (!h->count)
+		return (0);
+
+	want = frac * h->count;
+	if (want < frac * h->count || want < 1)
+		want++;
+	for (i = 0; i < STATS_BUCKETS - 1; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			break;
+	}
+	if (i == STATS_BUCKETS - 1)
+		return (h->max_us);
+	return ((2UL << i) - 1 < h->max_us ? (2UL << i) - 1 : h->max_us);
+}
@@ -0,0 +1,156 @@
+/* 		modbus_stats.h
+
+   Where the time of the master's transactions goes, and how they end.
+
+   Every transaction, blocking or run by an rtu_loop, is timed at
+   five points:
+
+	tx_start   the query write begins, after the t3.5 gap
+	tx_end     the write has returned
+	rx_first   the first reply byte has been read
+	rx_last    the last reply byte has been read
+	done       the frame is declared complete, or given up on
+
+   The phases between them (transmit, slave turnaround, reception,
+   end of frame) and the whole round trip go into histograms, and
+   every transaction is counted by outcome, in total, per slave and
+   per function code. Recording costs a few clock reads and adds per
+   transaction, under a mutex so that ports used from different
+   threads can record at once; reading it is a copy.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_STATS_H
+#define MODBUS_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define STATS_BUCKETS 24	/* bucket i counts times of 2^i .. 2^(i+1) - 1 uS, */
+				/* bucket 0 also the ones under 1 uS            */
+#define STATS_SLAVES 256	/* by slave address */
+#define STATS_FUNCTIONS 24	/* by function code 0 .. 23 */
+
+
+
+/* CLOCK_MONOTONIC nS; 0 for a point the transaction never reached */
+struct modbus_txn_times {
+	long long tx_start;
+	long long tx_end;
+	long long rx_first;
+	long long rx_last;
+	long long done;
+};
+
+struct modbus_counters {
+	unsigned long transactions;
+	unsigned long ok;
+	unsigned long timeouts;		/* no reply at all */
+	unsigned long crc_errors;	/* a reply, but not a good one */
+	unsigned long exceptions;
+	unsigned long port_failures;
+};
+
+struct modbus_histogram {
+	unsigned long count;
+	unsigned long long total_us;
+	unsigned long max_us;
+	unsigned long bucket[STATS_BUCKETS];
+};
+
+struct modbus_stats_entry {
+	struct modbus_counters counters;
+	struct modbus_histogram round_trip;	/* tx_start to done */
+};
+
+struct modbus_stats {
+	struct modbus_counters total;
+
+	/* phases of the transactions that got a reply */
+	struct modbus_histogram transmit;	/* tx_start to tx_end */
+	struct modbus_histogram turnaround;	/* tx_end to rx_first */
+	struct modbus_histogram reception;	/* rx_first to rx_last */
+	struct modbus_histogram frame_end;	/* rx_last to done */
+	struct modbus_histogram round_trip;	/* tx_start to done */
+
+	struct modbus_stats_entry slave[STATS_SLAVES];
+	struct modbus_stats_entry function[STATS_FUNCTIONS];
+
+	struct modbus_txn_times last;	/* of the latest transaction */
+};
+
+
+
+/************************************************************************
+
+	modbus_stats_snapshot()	modbus_stats_reset()
+
+	copy out everything recorded since the start or the last reset,
+	and start again from zero.
+
+*************************************************************************/
+
+void modbus_stats_snapshot( struct modbus_stats *out );
+
+void modbus_stats_reset( void );
+
+
+
+/************************************************************************
+
+	stats_percentile()
+
+	a time under which frac (0.5, 0.99 ...) of a histogram's
+	entries fall: the top of the bucket that reaches frac, so at
+	most twice the real value. 0 for an empty histogram.
+
+*************************************************************************/
+
+unsigned long stats_percentile( const struct modbus_histogram *h,
+				double frac );
+
+
+
+/************************************************************************
+
+	stats_now()	stats_record()	stats_count()
+
+	for the master code: stats_now() is the clock the times are
+	read from, stats_record() adds a finished transaction. status
+	is the value the call returns; rx_bytes the reply bytes that
+	came in, which tells a timeout from a bad reply. stats_count()
+	only counts the outcome, into c.
+
+*************************************************************************/
+
+long long stats_now( void );
+
+void stats_record( const unsigned char *query,
+		   const struct modbus_txn_times *times,
+		   int status, int rx_bytes );
+
+void stats_count( struct modbus_counters *c, int status, int rx_bytes );
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MODBUS_STATS_H */
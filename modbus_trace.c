@@ -0,0 +1,236 @@
+/* modbus_trace.c
+
+   Lock-free frame trace.
+
+   The ring is a bounded queue of slots with a sequence number each
+   (D. Vyukov's design). A writer claims the slot at head with a
+   compare and swap on head, fills it in and then publishes it by
+   setting the slot's sequence to pos + 1. The reader takes the slot
+   at tail once its sequence says it is full and hands it back by
+   setting the sequence to pos + size. A writer that finds the slot
+   at head still full drops its record. Any number of threads may
+   write; one may read.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, US
+
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "modbus_trace.h"
+#include "modbus_stats.h"
+
+#define PRINT_IDLE_NS 5000000L	/* the printer looks again after 5 mS */
+
+struct trace_slot {
+	atomic_ulong seq;
+	struct trace_record rec;
+};
+
+static struct trace_slot *ring;
+static unsigned long ring_mask;
+static atomic_int tracing;
+static atomic_ulong head;
+static unsigned long tail;
+static atomic_ulong dropped;
+static long long trace_t0;
+
+
+
+
+/*************************************************************************
+
+	trace_start / trace_stop
+
+**************************************************************************/
+
+int trace_start(unsigned int records)
+{
+	unsigned long size = 1, i;
+
+	if (ring) {
+		atomic_store_explicit(&tracing, 1, memory_order_release);
+		return (0);
+	}
+
+	while (size < records)
+		size <<= 1;
+
+	ring = malloc(size * sizeof(*ring));
+	if (!ring)
+		return (-1);
+	for (i = 0; i < size; i++)
+		atomic_init(&ring[i].seq, i);
+	ring_mask = size - 1;
+	trace_t0 = stats_now();
+
+	/* publishes ring and ring_mask to the writers */
+	atomic_store_explicit(&tracing, 1, memory_order_release);
+	return (0);
+}
+
+void trace_stop(void)
+{
+	atomic_store(&tracing, 0);
+}
+
+
+
+
+/*************************************************************************
+
+	trace_frame
+
+**************************************************************************/
+
+void trace_frame(int dir, int fd, const unsigned char *data, int length)
+{
+	struct trace_slot *slot;
+	unsigned long pos, seq;
+
+	if (!atomic_load_explicit(&tracing, memory_order_acquire))
+		return;
+
+	pos = atomic_load_explicit(&head, memory_order_relaxed);
+	for (;;) {
+		slot = &ring[pos & ring_mask];
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(&head, &pos,
+					pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if ((long) (seq - pos) < 0) {
+			/* the reader has not got this far */
+			atomic_fetch_add_explicit(&dropped, 1,
+						  memory_order_relaxed);
+			return;
+		} else {
+			pos = atomic_load_explicit(&head,
+						   memory_order_relaxed);
+		}
+	}
+
+	if (length < 0 || !data)
+		length = 0;
+	if (length > sizeof(slot->rec.data))
+		length = sizeof(slot->rec.data);
+
+	slot->rec.ns = stats_now();
+	slot->rec.fd = fd;
+	slot->rec.dir = dir;
+	slot->rec.length = length;
+	if (length)
+		memcpy(slot->rec.data, data, length);
+
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+
+
+
+/*************************************************************************
+
+	trace_read / trace_dropped
+
+**************************************************************************/
+
+int trace_read(struct trace_record *rec)
+{
+	struct trace_slot *slot;
+
+	if (!ring)
+		return (0);
+
+	slot = &ring[tail & ring_mask];
+	if (atomic_load_explicit(&slot->seq, memory_order_acquire)
+	    != tail + 1)
+		return (0);
+
+	memcpy(rec, &slot->rec, offsetof(struct trace_record, data)
+	       + slot->rec.length);
+	atomic_store_explicit(&slot->seq, tail + ring_mask + 1,
+			      memory_order_release);
+	tail++;
+	return (1);
+}
+
+unsigned long trace_dropped(void)
+{
+	return (atomic_load_explicit(&dropped, memory_order_relaxed));
+}
+
+
+
+
+/*************************************************************************
+
+	trace_print / trace_print_thread
+
+**************************************************************************/
+
+void trace_print(FILE *f, const struct trace_record *rec)
+{
+	static const char *dirs[] = { "??", "TX", "RX", "TIMEOUT" };
+	long long ns = rec->ns - trace_t0;
+	int i;
+
+	fprintf(f, "%5lld.%06lld fd %d %s", ns / 1000000000LL,
+		ns % 1000000000LL / 1000, rec->fd,
+		dirs[rec->dir <= TRACE_TIMEOUT ? rec->dir : 0]);
+	if (rec->length)
+		fputc(' ', f);
+	for (i = 0; i < rec->length; i++)
+		fprintf(f, rec->dir == TRACE_TX ? "[%02X]" : "<%02X>",
+			rec->data[i]);
+	fputc('\n', f);
+}
+
+static void *print_loop(void *arg)
+{
+	FILE *f = arg;
+	struct trace_record rec;
+	struct timespec idle = { 0, PRINT_IDLE_NS };
+	unsigned long lost, reported = 0;
+
+	for (;;) {
+		while (trace_read(&rec))
+			trace_print(f, &rec);
+
+		lost = trace_dropped();
+		if (lost != reported) {
+			fprintf(f, "trace: %lu records dropped\n",
+				lost - reported);
+			reported = lost;
+		}
+		fflush(f);
+		nanosleep(&idle, NULL);
+	}
+	return (NULL);
+}
+
+int trace_print_thread(FILE *f)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, print_loop, f) != 0)
+		return (-1);
+	pthread_detach(thread);
+	return (0);
+}
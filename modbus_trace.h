@@ -0,0 +1,138 @@
+/* 		modbus_trace.h
+
+   Binary trace of the frames the master sends and receives.
+
+   Tracing writes one fixed size record per frame into a ring buffer
+   and does nothing else on the bus path: no formatting, no I/O, no
+   lock. A reader, normally another thread, takes the records out
+   and prints them. When the reader falls behind, new records are
+   dropped and counted rather than waiting for it, so tracing never
+   changes the timing of the bus.
+
+   Tracing is off until trace_start(). Setting MODBUS_TRACE in the
+   environment (to the number of records, or to anything for the
+   default) turns it on with a printer thread on stderr when
+   set_up_comms() opens the first port.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef MODBUS_TRACE_H
+#define MODBUS_TRACE_H
+
+#include <stdio.h>
+#include "modbus_rtu.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#define TRACE_DEFAULT_RECORDS 1024
+
+enum {
+	TRACE_TX = 1,		/* a query, checksum included */
+	TRACE_RX,		/* the reply bytes that came in */
+	TRACE_TIMEOUT		/* no reply; no data */
+};
+
+struct trace_record {
+	long long ns;		/* CLOCK_MONOTONIC */
+	int fd;
+	unsigned char dir;	/* TRACE_TX ... */
+	unsigned short length;
+	unsigned char data[MAX_RESPONSE_LENGTH];
+};
+
+
+
+/************************************************************************
+
+	trace_start()	trace_stop()
+
+	trace_start() sets up a ring of records entries, rounded up to
+	a power of two, and starts tracing; after trace_stop() it starts
+	again on the ring it has. trace_stop() stops it; the records not
+	read yet can still be read.
+
+	Returns:	0 if OK, -1 if out of memory
+
+*************************************************************************/
+
+int trace_start( unsigned int records );
+
+void trace_stop( void );
+
+
+
+/************************************************************************
+
+	trace_frame()
+
+	adds a record if tracing is on. Called by the master code;
+	length is cut to the size of a record.
+
+*************************************************************************/
+
+void trace_frame( int dir, int fd, const unsigned char *data, int length );
+
+
+
+/************************************************************************
+
+	trace_read()	trace_dropped()
+
+	trace_read() takes the oldest record out of the ring. Only one
+	thread may read.
+
+	Returns:	1 if rec was filled in, 0 if the ring is empty
+
+	trace_dropped() is the number of records lost to a full ring.
+
+*************************************************************************/
+
+int trace_read( struct trace_record *rec );
+
+unsigned long trace_dropped( void );
+
+
+
+/************************************************************************
+
+	trace_print()	trace_print_thread()
+
+	trace_print() writes a record as one line of text:
+
+		   12.345678 fd 3 TX [01][03][00][00][00][0A][C5][CD]
+
+	the time in seconds since trace_start(). trace_print_thread()
+	starts a thread that prints every record to f as it comes in.
+
+	Returns:	0 if OK, -1 if the thread cannot be started
+
+*************************************************************************/
+
+void trace_print( FILE *f, const struct trace_record *rec );
+
+int trace_print_thread( FILE *f );
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* MODBUS_TRACE_H */